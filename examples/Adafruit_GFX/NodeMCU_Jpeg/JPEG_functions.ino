@@ -36,6 +36,7 @@ void drawJpeg(const char *filename, int xpos, int ypos) {
 
     // render the image onto the screen at given coordinates
     jpegRender(xpos, ypos);
+    //jpegRenderBands(xpos, ypos); // or draw a whole row of MCUs at a time
   }
   else {
     Serial.println("Jpeg file format not supported!");
@@ -118,6 +119,53 @@ void jpegRender(int xpos, int ypos) {
 
 }
 
+//====================================================================================
+//   Decode and render the Jpeg image a full width strip (band) of MCUs at a time
+//====================================================================================
+// This needs a buffer for width x MCUHeight pixels, but sets the TFT window once per
+// band instead of once per MCU, which is much faster for large images.
+void jpegRenderBands(int xpos, int ypos) {
+
+  uint32_t band_size = JpegDec.width * JpegDec.MCUHeight;
+  uint16_t *pBand = (uint16_t *)malloc(band_size * sizeof(uint16_t));
+
+  if (!pBand) {
+    Serial.println("Not enough memory for a band, drawing MCUs instead");
+    jpegRender(xpos, ypos);
+    return;
+  }
+
+  // record the current time so we can measure how long it takes to draw an image
+  uint32_t drawTime = millis();
+
+  int band_h;
+
+  // read each band until there are no more
+  while ((band_h = JpegDec.readBand(pBand, band_size))) {
+
+    int band_y = JpegDec.MCUy * JpegDec.MCUHeight + ypos;
+
+    // stop once the bands are below the bottom of the screen
+    if (band_y >= tft.height()) {
+      JpegDec.abort();
+      break;
+    }
+
+    // drawRGBBitmap() clips each pixel, so images wider than the screen are cropped
+    tft.drawRGBBitmap(xpos, band_y, pBand, JpegDec.width, minimum(band_h, tft.height() - band_y));
+  }
+
+  free(pBand);
+
+  // calculate how long it took to draw the image
+  drawTime = millis() - drawTime; // Calculate the time it took
+
+  // print the results to the serial port
+  Serial.print  ("Total render time was    : "); Serial.print(drawTime); Serial.println(" ms");
+  Serial.println("=====================================");
+
+}
+
 //====================================================================================
 //   Print information decoded from the Jpeg image
 //====================================================================================
@@ -0,0 +1,223 @@
+/*
+jpeg_bench.cpp
+
+Decodes Jpeg images natively on a PC with the JPEGDecoder library and reports the
+decode speed, see CMakeLists.txt in the library folder. Build and run with:
+
+  cmake -S . -B build && cmake --build build
+  ./build/jpeg_bench [-n iterations] [-s scale] [-f] [-u] [-c x,y,w,h] [-t w,h] [-m] [-k] [-v] [image.jpg ...]
+
+With no images named the ones in the library's extras folder are used. Each image is
+decoded from memory with decodeArray() and every MCU is read with read(), -f decodes
+it from the file with decodeFile() instead, -u turns on setFancyUpsampling() and -c
+only decodes the MCU's in a rectangle with setClipRect() and -t decodes the EXIF thumbnail
+instead if it is at least w x h with setThumbnailSize(). -m decodes the images as the frames
+of an MJPEG stream with setMjpeg() and -k keeps the tables between images with setKeepTables().
+MB/s is for the Jpeg (compressed) data. -v doesn't time the images but checks that
+decodeArray() and decodeFile() give the same pixels for them and for copies cut short.
+The checksum of the output pixels lets results be compared between builds.
+
+When built with PJPG_STATS (cmake -DJPEG_STATS=ON) the time spent in each stage of
+the last decode of each image and the decoder's counters are listed too.
+*/
+
+#include <JPEGDecoder.h>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifndef JPEG_BENCH_DIR
+  #define JPEG_BENCH_DIR "extras"
+#endif
+
+static bool loadFile(const std::string& name, std::vector<uint8_t>& data) {
+	FILE *f = fopen(name.c_str(), "rb");
+	if (!f) return false;
+
+	fseek(f, 0, SEEK_END);
+	data.resize(ftell(f));
+	fseek(f, 0, SEEK_SET);
+
+	bool ok = fread(data.data(), 1, data.size(), f) == data.size();
+	fclose(f);
+	return ok;
+}
+
+// Reads every MCU of the image, returns a checksum of the pixels or 0 on failure
+static uint32_t readImage(void) {
+	uint32_t sum = 2166136261U; // FNV-1a
+
+	while (JpegDec.read()) {
+		uint16_t *pImg = JpegDec.pImage;
+		int n = JpegDec.MCUWidth * JpegDec.MCUHeight;
+
+		for (int i = 0; i < n; i++) sum = (sum ^ pImg[i]) * 16777619U;
+	}
+	return sum ? sum : 1;
+}
+
+static uint32_t decodeImage(const std::string& name, const std::vector<uint8_t>& data, bool from_file) {
+	int ok = from_file ? JpegDec.decodeFile(name.c_str()) : JpegDec.decodeArray(data.data(), data.size());
+
+	return ok == 1 ? readImage() : 0;
+}
+
+// Decodes the image, whole and cut short, from memory and from a file. Both are read the
+// same way up to the end of the data, past which the decoder pads them with EOI markers.
+static bool verifyImage(const std::string& name, const std::vector<uint8_t>& data) {
+	static const int cuts[] = { 1000, 999, 900, 500 }; // per mille of the image
+	char path[] = "/tmp/jpeg_bench_XXXXXX";
+	bool ok = true;
+
+	int fd = mkstemp(path);
+	if (fd < 0) return false;
+	close(fd);
+
+	for (int cut : cuts) {
+		std::vector<uint8_t> part(data.begin(), data.begin() + data.size() * cut / 1000);
+
+		FILE *f = fopen(path, "wb");
+		bool written = f && fwrite(part.data(), 1, part.size(), f) == part.size();
+		if (f) fclose(f);
+		if (!written) {
+			ok = false;
+			break;
+		}
+
+		uint32_t sum_array = decodeImage(path, part, false);
+		uint32_t sum_file = decodeImage(path, part, true);
+
+		if (sum_array != sum_file) {
+			printf("%-32s %5.1f%%  array %08x file %08x\n", name.c_str(), cut / 10.0, (unsigned)sum_array, (unsigned)sum_file);
+			ok = false;
+		}
+	}
+
+	remove(path);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	std::vector<std::string> names;
+	int iterations = 10;
+	int scale = 1;
+	bool from_file = false;
+	bool fancy = false;
+	int clip[4] = { 0, 0, 0, 0 };
+	int thumb[2] = { 0, 0 };
+	bool mjpeg = false;
+	bool keep = false;
+	bool verify = false;
+
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+
+		if (arg == "-n" && i + 1 < argc) iterations = atoi(argv[++i]);
+		else if (arg == "-s" && i + 1 < argc) scale = atoi(argv[++i]);
+		else if (arg == "-f") from_file = true;
+		else if (arg == "-u") fancy = true;
+		else if (arg == "-c" && i + 1 < argc) sscanf(argv[++i], "%d,%d,%d,%d", &clip[0], &clip[1], &clip[2], &clip[3]);
+		else if (arg == "-t" && i + 1 < argc) sscanf(argv[++i], "%d,%d", &thumb[0], &thumb[1]);
+		else if (arg == "-m") mjpeg = true;
+		else if (arg == "-k") keep = true;
+		else if (arg == "-v") verify = true;
+		else if (arg[0] == '-') {
+			fprintf(stderr, "usage: %s [-n iterations] [-s scale] [-f] [-u] [-c x,y,w,h] [-t w,h] [-m] [-k] [-v] [image.jpg ...]\n", argv[0]);
+			return 2;
+		}
+		else names.push_back(arg);
+	}
+
+	if (iterations < 1) iterations = 1;
+
+	if (names.empty()) {
+		DIR *dir = opendir(JPEG_BENCH_DIR);
+		if (!dir) {
+			fprintf(stderr, "Can't open %s\n", JPEG_BENCH_DIR);
+			return 1;
+		}
+		while (struct dirent *ent = readdir(dir)) {
+			std::string file = ent->d_name;
+			if (file.size() > 4 && file.compare(file.size() - 4, 4, ".jpg") == 0)
+				names.push_back(std::string(JPEG_BENCH_DIR) + "/" + file);
+		}
+		closedir(dir);
+		std::sort(names.begin(), names.end());
+	}
+
+	JpegDec.setScale(scale);
+	JpegDec.setFancyUpsampling(fancy);
+	JpegDec.setClipRect(clip[0], clip[1], clip[2], clip[3]);
+	JpegDec.setThumbnailSize(thumb[0], thumb[1]);
+	JpegDec.setMjpeg(mjpeg);
+	JpegDec.setKeepTables(keep);
+
+	if (!verify)
+		printf("%-32s %11s %8s %10s %10s %12s  %s\n", "image", "size", "bytes", "ms", "MB/s", "MCUs/s", "checksum");
+
+	double total_bytes = 0, total_mcus = 0, total_secs = 0;
+	int failed = 0;
+
+	for (const std::string& name : names) {
+		std::vector<uint8_t> data;
+
+		if (!loadFile(name, data)) {
+			printf("%-32s can't be read\n", name.c_str());
+			failed++;
+			continue;
+		}
+
+		if (verify) {
+			bool ok = verifyImage(name, data);
+			printf("%-32s %s\n", name.c_str(), ok ? "array and file agree" : "FAILED");
+			if (!ok) failed++;
+			continue;
+		}
+
+		// The first decode warms the caches and checks the image can be decoded
+		uint32_t sum = decodeImage(name, data, from_file);
+		if (!sum) {
+			printf("%-32s failed to decode\n", name.c_str());
+			failed++;
+			continue;
+		}
+
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) decodeImage(name, data, from_file);
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+		double mcus = (double)JpegDec.MCUSPerRow * JpegDec.MCUSPerCol;
+		char size[24];
+		snprintf(size, sizeof(size), "%dx%d", JpegDec.width, JpegDec.height);
+
+		printf("%-32s %11s %8u %10.3f %10.2f %12.0f  %08x\n", name.c_str(), size, (unsigned)data.size(),
+		       secs * 1000.0, data.size() / secs / 1e6, mcus / secs, (unsigned)sum);
+
+#if PJPG_STATS
+		const pjpeg_stats_t *pStats = JpegDec.getStats();
+		double us = 1e6 / PJPG_STATS_CLOCK_HZ;
+
+		printf("  us: input %.0f decode %.0f idct %.0f color %.0f output %.0f\n",
+		       pStats->m_inputTicks * us, pStats->m_decodeTicks * us, pStats->m_idctTicks * us,
+		       pStats->m_colorTicks * us, pStats->m_outputTicks * us);
+		printf("  bytes %lu reads %lu MCUs %lu skipped %lu blocks %lu dc only rows %lu cols %lu restarts %lu scans %lu tables kept %lu\n",
+		       pStats->m_bytesRead, pStats->m_inputCalls, pStats->m_MCUs, pStats->m_skippedMCUs, pStats->m_blocks,
+		       pStats->m_dcOnlyRows, pStats->m_dcOnlyCols, pStats->m_restarts, pStats->m_scans, pStats->m_tablesKept);
+#endif
+
+		total_bytes += data.size();
+		total_mcus += mcus;
+		total_secs += secs;
+	}
+
+	if (total_secs > 0)
+		printf("%-32s %11s %8.0f %10.3f %10.2f %12.0f\n", "total", "", total_bytes, total_secs * 1000.0,
+		       total_bytes / total_secs / 1e6, total_mcus / total_secs);
+
+	return failed ? 1 : 0;
+}
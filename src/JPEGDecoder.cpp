@@ -41,30 +41,59 @@ Bodmer (26/2/22): Removed deprecated SPIFFS
 #include "JPEGDecoder.h"
 #include "picojpeg.h"
 
+#ifdef LOAD_POSIX_FILE
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/stat.h>
+#endif
+
+#ifdef JPEG_PARALLEL_DECODE
+  #include <thread>
+  #include <atomic>
+#endif
+
 JPEGDecoder JpegDec;
 
 JPEGDecoder::JPEGDecoder(){
 	mcu_x = 0 ;
 	mcu_y = 0 ;
 	is_available = 0;
+	pImage = NULL; // Only JpegDec is zeroed before construction
 	thisPtr = this;
 }
 
 
 JPEGDecoder::~JPEGDecoder(){
-	if (pImage) delete[] pImage;
+	if (pImage && pImage != user_image && pImage != mjpeg_image) delete[] pImage;
 	pImage = NULL;
+	if (mjpeg_image) delete[] mjpeg_image;
+	mjpeg_image = NULL;
+	if (heap_coeffs) delete[] heap_coeffs;
+	heap_coeffs = NULL;
 }
 
 
-uint8_t JPEGDecoder::pjpeg_callback(uint8_t* pBuf, uint8_t buf_size, uint8_t *pBytes_actually_read, void *pCallback_data) {
-	JPEGDecoder *thisPtr = JpegDec.thisPtr ;
+// pCallback_data is the JPEGDecoder reading the image, so each instance reads its own source
+uint8_t JPEGDecoder::pjpeg_callback(uint8_t* pBuf, pjpeg_size_t buf_size, pjpeg_size_t *pBytes_actually_read, void *pCallback_data) {
+	JPEGDecoder *thisPtr = (JPEGDecoder *)pCallback_data;
+
+	// Files are read a whole buffer at a time (4KB by default, see PJPG_MAX_IN_BUF_SIZE). The
+	// first read is at offset 0, after a seek a short read gets them aligned to the size again
+	buf_size -= (thisPtr->jpg_base + thisPtr->g_nInFileOfs) % buf_size;
+
 	thisPtr->pjpeg_need_bytes_callback(pBuf, buf_size, pBytes_actually_read, pCallback_data);
 	return 0;
 }
 
 
-uint8_t JPEGDecoder::pjpeg_need_bytes_callback(uint8_t* pBuf, uint8_t buf_size, uint8_t *pBytes_actually_read, void *pCallback_data) {
+// Skips n bytes of the image by seeking the source, non-zero has picojpeg read them instead
+uint8_t JPEGDecoder::pjpeg_skip_callback(unsigned long n, void *pCallback_data) {
+	JPEGDecoder *thisPtr = (JPEGDecoder *)pCallback_data;
+	return thisPtr->seekSource(thisPtr->g_nInFileOfs + n) ? 0 : 1;
+}
+
+
+uint8_t JPEGDecoder::pjpeg_need_bytes_callback(uint8_t* pBuf, pjpeg_size_t buf_size, pjpeg_size_t *pBytes_actually_read, void *pCallback_data) {
 	uint n;
 
 	pCallback_data = pCallback_data; // Supress warning
@@ -72,10 +101,8 @@ uint8_t JPEGDecoder::pjpeg_need_bytes_callback(uint8_t* pBuf, uint8_t buf_size,
 	n = jpg_min(g_nInFileSize - g_nInFileOfs, buf_size);
 
 	if (jpg_source == JPEG_ARRAY) { // We are handling an array
-		for (uint i = 0; i < n; i++) {
-			pBuf[i] = pgm_read_byte(jpg_data++);
-			//Serial.println(pBuf[i],HEX);
-		}
+		memcpy_P(pBuf, jpg_data, n);
+		jpg_data += n;
 	}
 
 #ifdef LOAD_FLASH_FS
@@ -86,14 +113,109 @@ uint8_t JPEGDecoder::pjpeg_need_bytes_callback(uint8_t* pBuf, uint8_t buf_size,
 	if (jpg_source == JPEG_SD_FILE) g_pInFileSd.read(pBuf,n); // else we are handling a file
 #endif
 
-	*pBytes_actually_read = (uint8_t)(n);
+#ifdef LOAD_POSIX_FILE
+	if (jpg_source == JPEG_POSIX_FILE) {
+		uint got = 0;
+		while (got < n) {
+			ssize_t r = ::read(g_nInFileFd, pBuf + got, n - got);
+			if (r <= 0) { n = got; break; } // Truncated file
+			got += r;
+		}
+	}
+#endif
+
+	*pBytes_actually_read = (pjpeg_size_t)(n);
 	g_nInFileOfs += n;
 	return 0;
 }
 
+
+// Moves the source so the callback's next read is from byte ofs of the image, returns 1 if it could.
+// Files are seeked to jpg_base + ofs, array pointers are moved on from the start of the image.
+int JPEGDecoder::seekSource(uint32_t ofs) {
+
+	if (ofs > g_nInFileSize) return 0;
+
+	if (jpg_source == JPEG_ARRAY) jpg_data = jpg_data - g_nInFileOfs + ofs;
+
+#ifdef LOAD_FLASH_FS
+	if (jpg_source == JPEG_FS_FILE && !g_pInFileFs.seek(jpg_base + ofs)) return 0;
+#endif
+
+#if defined (LOAD_SD_LIBRARY) || defined (LOAD_SDFAT_LIBRARY)
+	if (jpg_source == JPEG_SD_FILE && !g_pInFileSd.seek(jpg_base + ofs)) return 0;
+#endif
+
+#ifdef LOAD_POSIX_FILE
+	if (jpg_source == JPEG_POSIX_FILE && lseek(g_nInFileFd, jpg_base + ofs, SEEK_SET) != (off_t)(jpg_base + ofs)) return 0;
+#endif
+
+	g_nInFileOfs = ofs;
+	return 1;
+}
+
+
+// Reads up to n bytes of the image from byte ofs, returns the number read
+uint32_t JPEGDecoder::readSource(uint32_t ofs, uint8_t *pBuf, uint32_t n) {
+
+	pjpeg_size_t got = 0;
+
+#ifdef JPEG_ARRAY_IN_PLACE
+	if (jpg_source == JPEG_ARRAY) { // jpg_data isn't moved by the callback for these
+		n = ofs < g_nInFileSize ? jpg_min(n, g_nInFileSize - ofs) : 0;
+		memcpy(pBuf, jpg_data + ofs, n);
+		return n;
+	}
+#endif
+
+	if (!seekSource(ofs)) return 0;
+
+	pjpeg_need_bytes_callback(pBuf, (pjpeg_size_t)n, &got, NULL);
+	return got;
+}
+
 int JPEGDecoder::decode_mcu(void) {
 
-	status = pjpeg_decode_mcu();
+	status = 0;
+
+	for (;;) {
+		// Nothing after the clip rectangle's last MCU is needed
+		if (mcu_y > clip_mcu_y1 || (mcu_y == clip_mcu_y1 && mcu_x > clip_mcu_x1)) {
+			status = PJPG_NO_MORE_BLOCKS;
+			is_available = 0;
+			return 1;
+		}
+
+		if (mcu_y >= clip_mcu_y0 && mcu_x >= clip_mcu_x0 && mcu_x <= clip_mcu_x1) break;
+
+		// MCU's outside it are only entropy decoded, for the DC predictions that follow,
+		// unless a restart index lets the decoder go straight to a later interval
+		if (restart_intervals) {
+			uint32_t mcu = (uint32_t)mcu_y * MCUSPerRow + mcu_x;
+			uint32_t target;
+
+			if (mcu_y < clip_mcu_y0) target = (uint32_t)clip_mcu_y0 * MCUSPerRow + clip_mcu_x0;
+			else if (mcu_x < clip_mcu_x0) target = (uint32_t)mcu_y * MCUSPerRow + clip_mcu_x0;
+			else target = (uint32_t)(mcu_y + 1) * MCUSPerRow + clip_mcu_x0;
+
+			if (target / image_info.m_restartInterval > mcu / image_info.m_restartInterval) {
+				status = seekInterval(target / image_info.m_restartInterval);
+				if (status) break;
+				continue;
+			}
+		}
+
+		status = pjpeg_skip_mcu_ctx(&pjpeg_ctx);
+		if (status) break;
+
+		mcu_x++;
+		if (mcu_x == image_info.m_MCUSPerRow) {
+			mcu_x = 0;
+			mcu_y++;
+		}
+	}
+
+	if (!status) status = pjpeg_decode_mcu_ctx(&pjpeg_ctx);
 
 	if (status) {
 		is_available = 0 ;
@@ -111,9 +233,23 @@ int JPEGDecoder::decode_mcu(void) {
 }
 
 
+// Convert the MCU left in the decoder's MCU buffers (as Y, Cb and Cr) to RGB565 in a
+// destination bitmap, clipping the MCU's at the right and bottom edges of the image.
+// shift is log2 of the scale the image was decoded at.
+void JPEGDecoder::copyMCU(const pjpeg_context_t *pCtx, const pjpeg_image_info_t *pInfo, int mcuX, int mcuY, uint16_t *pDst_row, uint pitch, uint8 shift, uint8 swap) {
+	const int mcu_width = pInfo->m_MCUWidth >> shift;
+	const int mcu_height = pInfo->m_MCUHeight >> shift;
+	const int scaled_width = (pInfo->m_width + (1 << shift) - 1) >> shift;
+	const int scaled_height = (pInfo->m_height + (1 << shift) - 1) >> shift;
+
+	const int cols = jpg_min(mcu_width, scaled_width - mcuX * mcu_width);
+	const int rows = jpg_min(mcu_height, scaled_height - mcuY * mcu_height);
+
+	pjpeg_mcu_to_rgb565_ctx(pCtx, pDst_row, pitch, cols, rows, swap);
+}
+
+
 int JPEGDecoder::read(void) {
-	int y, x;
-	uint16_t *pDst_row;
 
 	if(is_available == 0 || mcu_y >= image_info.m_MCUSPerCol) {
 		abort();
@@ -121,65 +257,13 @@ int JPEGDecoder::read(void) {
 	}
 	
 	// Copy MCU's pixel blocks into the destination bitmap.
-	pDst_row = pImage;
-	for (y = 0; y < image_info.m_MCUHeight; y += 8) {
-
-		const int by_limit = jpg_min(8, image_info.m_height - (mcu_y * image_info.m_MCUHeight + y));
-
-		for (x = 0; x < image_info.m_MCUWidth; x += 8) {
-			uint16_t *pDst_block = pDst_row + x;
-
-			// Compute source byte offset of the block in the decoder's MCU buffer.
-			uint src_ofs = (x * 8U) + (y * 16U);
-			const uint8_t *pSrcR = image_info.m_pMCUBufR + src_ofs;
-			const uint8_t *pSrcG = image_info.m_pMCUBufG + src_ofs;
-			const uint8_t *pSrcB = image_info.m_pMCUBufB + src_ofs;
-
-			const int bx_limit = jpg_min(8, image_info.m_width - (mcu_x * image_info.m_MCUWidth + x));
-
-			if (image_info.m_scanType == PJPG_GRAYSCALE) {
-				int bx, by;
-				for (by = 0; by < by_limit; by++) {
-					uint16_t *pDst = pDst_block;
-
-					for (bx = 0; bx < bx_limit; bx++) {
-#ifdef SWAP_BYTES
-						*pDst++ = (*pSrcR & 0xF8) | (*pSrcR & 0xE0) >> 5 | (*pSrcR & 0xF8) << 5 | (*pSrcR & 0x1C) << 11;
-#else
-						*pDst++ = (*pSrcR & 0xF8) << 8 | (*pSrcR & 0xFC) <<3 | *pSrcR >> 3;
+#if PJPG_STATS
+	unsigned long t = PJPG_STATS_CLOCK();
 #endif
-						pSrcR++;
-					}
-
-					pSrcR += (8 - bx_limit);
-
-					pDst_block += row_pitch;
-				}
-			}
-			else {
-				int bx, by;
-				for (by = 0; by < by_limit; by++) {
-					uint16_t *pDst = pDst_block;
-
-					for (bx = 0; bx < bx_limit; bx++) {
-#ifdef SWAP_BYTES
-						*pDst++ = (*pSrcR & 0xF8) | (*pSrcG & 0xE0) >> 5 | (*pSrcB & 0xF8) << 5 | (*pSrcG & 0x1C) << 11;
-#else
-						*pDst++ = (*pSrcR & 0xF8) << 8 | (*pSrcG & 0xFC) <<3 | *pSrcB >> 3;
+	copyMCU(&pjpeg_ctx, &image_info, mcu_x, mcu_y, pImage, row_pitch, scale_shift, SWAP_PIXELS);
+#if PJPG_STATS
+	pjpeg_ctx.mStats.m_outputTicks += PJPG_STATS_CLOCK() - t;
 #endif
-						pSrcR++; pSrcG++; pSrcB++;
-					}
-
-					pSrcR += (8 - bx_limit);
-					pSrcG += (8 - bx_limit);
-					pSrcB += (8 - bx_limit);
-
-					pDst_block += row_pitch;
-				}
-			}
-		}
-		pDst_row += (row_pitch * 8);
-	}
 
 	MCUx = mcu_x;
 	MCUy = mcu_y;
@@ -195,67 +279,55 @@ int JPEGDecoder::read(void) {
 	return 1;
 }
 
-int JPEGDecoder::readSwappedBytes(void) {
-	int y, x;
-	uint16_t *pDst_row;
+int JPEGDecoder::readBand(uint16_t *pBand, uint32_t band_size) {
 
-	if(is_available == 0 || mcu_y >= image_info.m_MCUSPerCol) {
+	if(is_available == 0 || mcu_y >= image_info.m_MCUSPerCol || band_size < (uint32_t)width * MCUHeight) {
 		abort();
 		return 0;
 	}
-	
-	// Copy MCU's pixel blocks into the destination bitmap.
-	pDst_row = pImage;
-	for (y = 0; y < image_info.m_MCUHeight; y += 8) {
-
-		const int by_limit = jpg_min(8, image_info.m_height - (mcu_y * image_info.m_MCUHeight + y));
-
-		for (x = 0; x < image_info.m_MCUWidth; x += 8) {
-			uint16_t *pDst_block = pDst_row + x;
-
-			// Compute source byte offset of the block in the decoder's MCU buffer.
-			uint src_ofs = (x * 8U) + (y * 16U);
-			const uint8_t *pSrcR = image_info.m_pMCUBufR + src_ofs;
-			const uint8_t *pSrcG = image_info.m_pMCUBufG + src_ofs;
-			const uint8_t *pSrcB = image_info.m_pMCUBufB + src_ofs;
-
-			const int bx_limit = jpg_min(8, image_info.m_width - (mcu_x * image_info.m_MCUWidth + x));
-
-			if (image_info.m_scanType == PJPG_GRAYSCALE) {
-				int bx, by;
-				for (by = 0; by < by_limit; by++) {
-					uint16_t *pDst = pDst_block;
 
-					for (bx = 0; bx < bx_limit; bx++) {
+	int band_y = mcu_y;
 
-						*pDst++ = (*pSrcR & 0xF8) | (*pSrcR & 0xE0) >> 5 | (*pSrcR & 0xF8) << 5 | (*pSrcR & 0x1C) << 11;
+	// Copy each MCU of the row into the strip, the pitch is the image width
+	while (is_available && mcu_y == band_y) {
+#if PJPG_STATS
+		unsigned long t = PJPG_STATS_CLOCK();
+#endif
+		copyMCU(&pjpeg_ctx, &image_info, mcu_x, mcu_y, pBand + mcu_x * MCUWidth, width, scale_shift, SWAP_PIXELS);
+#if PJPG_STATS
+		pjpeg_ctx.mStats.m_outputTicks += PJPG_STATS_CLOCK() - t;
+#endif
 
-						pSrcR++;
-					}
-				}
-			}
-			else {
-				int bx, by;
-				for (by = 0; by < by_limit; by++) {
-					uint16_t *pDst = pDst_block;
+		MCUx = mcu_x;
+		MCUy = mcu_y;
 
-					for (bx = 0; bx < bx_limit; bx++) {
+		mcu_x++;
+		if (mcu_x == image_info.m_MCUSPerRow) {
+			mcu_x = 0;
+			mcu_y++;
+		}
 
-						*pDst++ = (*pSrcR & 0xF8) | (*pSrcG & 0xE0) >> 5 | (*pSrcB & 0xF8) << 5 | (*pSrcG & 0x1C) << 11;
+		if(decode_mcu()==-1) is_available = 0 ;
+	}
 
-						pSrcR++; pSrcG++; pSrcB++;
-					}
+	return jpg_min(MCUHeight, height - band_y * MCUHeight);
+}
 
-					pSrcR += (8 - bx_limit);
-					pSrcG += (8 - bx_limit);
-					pSrcB += (8 - bx_limit);
+int JPEGDecoder::readSwappedBytes(void) {
 
-					pDst_block += row_pitch;
-				}
-			}
-		}
-		pDst_row += (row_pitch * 8);
+	if(is_available == 0 || mcu_y >= image_info.m_MCUSPerCol) {
+		abort();
+		return 0;
 	}
+	
+	// Copy MCU's pixel blocks into the destination bitmap.
+#if PJPG_STATS
+	unsigned long t = PJPG_STATS_CLOCK();
+#endif
+	copyMCU(&pjpeg_ctx, &image_info, mcu_x, mcu_y, pImage, row_pitch, scale_shift, 1);
+#if PJPG_STATS
+	pjpeg_ctx.mStats.m_outputTicks += PJPG_STATS_CLOCK() - t;
+#endif
 
 	MCUx = mcu_x;
 	MCUy = mcu_y;
@@ -286,6 +358,10 @@ int JPEGDecoder::decodeFile(const char *pFilename){
 	return decodeSdFile(pFilename);
 #endif
 
+#ifdef LOAD_POSIX_FILE
+	return decodePosixFile(open(pFilename, O_RDONLY));
+#endif
+
 	return -1;
 }
 
@@ -302,6 +378,10 @@ int JPEGDecoder::decodeFile(const String& pFilename){
 	return decodeSdFile(pFilename);
 #endif
 
+#ifdef LOAD_POSIX_FILE
+	return decodeFile(pFilename.c_str());
+#endif
+
 	return -1;
 }
 
@@ -325,6 +405,8 @@ int JPEGDecoder::decodeFsFile(const String& pFilename) {
 
 int JPEGDecoder::decodeFsFile(fs::File jpgFile) { // This is for the Little_FS library
 
+	abort(); // Closes any file left open by the last image
+
 	g_pInFileFs = jpgFile;
 
 	jpg_source = JPEG_FS_FILE; // Flag to indicate a Little_FS file
@@ -372,6 +454,8 @@ int JPEGDecoder::decodeSdFile(const String& pFilename) {
 
 int JPEGDecoder::decodeSdFile(File jpgFile) { // This is for the SD library
 
+	abort(); // Closes any file left open by the last image
+
 	g_pInFileSd = jpgFile;
 
 	jpg_source = JPEG_SD_FILE; // Flag to indicate a SD file
@@ -394,8 +478,40 @@ int JPEGDecoder::decodeSdFile(File jpgFile) { // This is for the SD library
 #endif
 
 
+#ifdef LOAD_POSIX_FILE
+
+int JPEGDecoder::decodePosixFile(int fd) { // This is for a native build on a PC
+
+	struct stat st;
+
+	abort(); // Closes any file left open by the last image
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		#ifdef DEBUG
+		Serial.println("ERROR: file not found!");
+		#endif
+
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	g_nInFileFd = fd;
+
+	jpg_source = JPEG_POSIX_FILE;
+
+	g_nInFileOfs = 0;
+
+	g_nInFileSize = st.st_size;
+
+	return decodeCommon();
+}
+#endif
+
+
 int JPEGDecoder::decodeArray(const uint8_t array[], uint32_t  array_size) {
 
+	abort(); // Releases the last image if it wasn't read to the end
+
 	jpg_source = JPEG_ARRAY; // We are not processing a file, use arrays
 
 	g_nInFileOfs = 0;
@@ -408,6 +524,700 @@ int JPEGDecoder::decodeArray(const uint8_t array[], uint32_t  array_size) {
 }
 
 
+int JPEGDecoder::decodeArray(const uint8_t array[], uint32_t  array_size, uint8_t scale) {
+
+	setScale(scale);
+
+	return decodeArray(array, array_size);
+}
+
+
+int JPEGDecoder::probeFile(const char *pFilename) {
+
+	probe_only = 1;
+	int ret = decodeFile(pFilename);
+	probe_only = 0;
+
+	return ret;
+}
+
+
+int JPEGDecoder::probeFile(const String& pFilename) {
+
+	probe_only = 1;
+	int ret = decodeFile(pFilename);
+	probe_only = 0;
+
+	return ret;
+}
+
+
+int JPEGDecoder::probeArray(const uint8_t array[], uint32_t  array_size) {
+
+	probe_only = 1;
+	int ret = decodeArray(array, array_size);
+	probe_only = 0;
+
+	return ret;
+}
+
+
+void JPEGDecoder::setOutputBuffer(uint16_t *pBuffer, uint32_t size) {
+
+	abort(); // Releases any heap buffer while user_image still tells them apart
+
+	user_image = pBuffer;
+	user_image_size = pBuffer ? size : 0;
+}
+
+
+void JPEGDecoder::setCoeffBuffer(int16_t *pBuffer, uint32_t size) {
+
+	abort();
+
+	user_coeffs = pBuffer;
+	user_coeffs_size = pBuffer ? size : 0;
+}
+
+
+void JPEGDecoder::setMaxScans(uint8_t scans) {
+
+	max_scans = scans;
+}
+
+
+void JPEGDecoder::setClipRect(int x, int y, int w, int h) {
+
+	clip_x = x;
+	clip_y = y;
+	clip_w = w;
+	clip_h = h;
+}
+
+
+// The range of MCU's that setClipRect()'s rectangle touches, all of them if there isn't one
+void JPEGDecoder::setClipMCUs(void) {
+
+	clip_mcu_x0 = 0;
+	clip_mcu_y0 = 0;
+	clip_mcu_x1 = MCUSPerRow - 1;
+	clip_mcu_y1 = MCUSPerCol - 1;
+
+	if (clip_w <= 0 || clip_h <= 0) return;
+
+	int x0 = jpg_max(clip_x, 0), x1 = jpg_min(clip_x + clip_w, width) - 1;
+	int y0 = jpg_max(clip_y, 0), y1 = jpg_min(clip_y + clip_h, height) - 1;
+
+	// Entirely off the image, nothing is decoded
+	if (x0 > x1 || y0 > y1) {
+		clip_mcu_y1 = -1;
+		return;
+	}
+
+	clip_mcu_x0 = x0 / MCUWidth;
+	clip_mcu_y0 = y0 / MCUHeight;
+	clip_mcu_x1 = x1 / MCUWidth;
+	clip_mcu_y1 = y1 / MCUHeight;
+}
+
+
+// Restart index blob: "JRI1", then little endian the image's size in bytes (4), width
+// (2), height (2), restart interval (2), number of intervals (4) and the byte offset
+// of each interval's first entropy coded byte (4 each). Intervals start byte aligned
+// after an RSTn marker (or the SOS header) so no bit position is needed.
+#define JPEG_INDEX_HEADER_SIZE 18
+
+static uint32_t getLE(const uint8_t *p, uint8_t n) {
+	uint32_t v = 0;
+	while (n--) v = (v << 8) | p[n];
+	return v;
+}
+
+static void putLE(uint8_t *p, uint32_t v, uint8_t n) {
+	while (n--) { *p++ = (uint8_t)v; v >>= 8; }
+}
+
+
+uint32_t JPEGDecoder::buildRestartIndex(uint8_t *pBlob, uint32_t blob_size) {
+
+	if (!pImage || progressive || !image_info.m_restartInterval) return 0;
+
+	uint32_t intervals = ((uint32_t)MCUSPerRow * MCUSPerCol + image_info.m_restartInterval - 1) / image_info.m_restartInterval;
+	uint32_t size = JPEG_INDEX_HEADER_SIZE + intervals * 4;
+
+	if (!pBlob || blob_size < size) return size;
+
+	uint8_t buf[64];
+	uint32_t ofs = 2, found = 0;
+
+	// Walk the marker segments to the scan data
+	for (;;) {
+		if (readSource(ofs, buf, 4) != 4 || buf[0] != 0xFF) break;
+
+		if (buf[1] == 0xFF) { ofs++; continue; } // Fill byte
+		if (buf[1] == 0x01 || (buf[1] >= 0xD0 && buf[1] <= 0xD7)) { ofs += 2; continue; }
+
+		ofs += 2 + ((buf[2] << 8) | buf[3]);
+
+		if (buf[1] == 0xDA) { // SOS
+			putLE(pBlob + JPEG_INDEX_HEADER_SIZE, ofs, 4);
+			found = 1;
+			break;
+		}
+	}
+
+	// Then look for the RSTn markers in it
+	uint8_t last = 0;
+
+	while (found && found < intervals) {
+		uint32_t n = readSource(ofs, buf, sizeof(buf));
+		if (!n) break;
+
+		for (uint32_t i = 0; i < n && found < intervals; i++) {
+			if (last == 0xFF && buf[i] >= 0xD0 && buf[i] <= 0xD7)
+				putLE(pBlob + JPEG_INDEX_HEADER_SIZE + found++ * 4, ofs + i + 1, 4);
+			else if (last == 0xFF && buf[i] != 0x00 && buf[i] != 0xFF) {
+				n = 0; // EOI, or another marker that shouldn't be here
+				break;
+			}
+			last = buf[i];
+		}
+
+		if (!n) break;
+		ofs += n;
+	}
+
+	abort(); // The source has been moved, it must be decoded again
+
+	if (found != intervals) return 0;
+
+	pBlob[0] = 'J'; pBlob[1] = 'R'; pBlob[2] = 'I'; pBlob[3] = '1';
+	putLE(pBlob + 4, g_nInFileSize, 4);
+	putLE(pBlob + 8, image_info.m_width, 2);
+	putLE(pBlob + 10, image_info.m_height, 2);
+	putLE(pBlob + 12, image_info.m_restartInterval, 2);
+	putLE(pBlob + 14, intervals, 4);
+
+	return size;
+}
+
+
+void JPEGDecoder::setRestartIndex(const uint8_t *pBlob, uint32_t blob_size) {
+
+	restart_index = pBlob;
+	restart_index_size = pBlob ? blob_size : 0;
+}
+
+
+// The number of intervals in the restart index if it is for the image being decoded, else 0
+uint32_t JPEGDecoder::checkRestartIndex(void) {
+
+	const uint8_t *p = restart_index;
+
+	if (!p || restart_index_size < JPEG_INDEX_HEADER_SIZE || progressive || !image_info.m_restartInterval) return 0;
+	if (p[0] != 'J' || p[1] != 'R' || p[2] != 'I' || p[3] != '1') return 0;
+
+	uint32_t intervals = getLE(p + 14, 4);
+
+	if (getLE(p + 4, 4) != g_nInFileSize || getLE(p + 8, 2) != (uint32_t)image_info.m_width ||
+	    getLE(p + 10, 2) != (uint32_t)image_info.m_height || getLE(p + 12, 2) != (uint32_t)image_info.m_restartInterval ||
+	    intervals != ((uint32_t)MCUSPerRow * MCUSPerCol + image_info.m_restartInterval - 1) / image_info.m_restartInterval ||
+	    restart_index_size < JPEG_INDEX_HEADER_SIZE + intervals * 4) {
+		#ifdef DEBUG
+		Serial.println("Restart index is not for this image, ignored");
+		#endif
+
+		return 0;
+	}
+
+	return intervals;
+}
+
+
+// Restarts decoding at the first MCU of a restart interval using the index, returns a picojpeg status
+uint8 JPEGDecoder::seekInterval(uint32_t interval) {
+
+	uint32_t ofs = getLE(restart_index + JPEG_INDEX_HEADER_SIZE + interval * 4, 4);
+	uint32_t mcu = interval * image_info.m_restartInterval;
+
+	if (interval >= restart_intervals || ofs > g_nInFileSize) return PJPG_BAD_RESTART_MARKER;
+
+#ifdef JPEG_ARRAY_IN_PLACE
+	if (jpg_source == JPEG_ARRAY)
+		status = pjpeg_decode_interval_init_mem_ctx(&pjpeg_ctx, &pjpeg_ctx, interval, jpg_data + ofs, g_nInFileSize - ofs);
+	else
+#endif
+	if (seekSource(ofs))
+		status = pjpeg_decode_interval_init_ctx(&pjpeg_ctx, &pjpeg_ctx, interval, pjpeg_callback, this);
+	else
+		status = PJPG_STREAM_READ_ERROR;
+
+	if (!status) {
+		mcu_x = mcu % MCUSPerRow;
+		mcu_y = mcu / MCUSPerRow;
+	}
+
+	return status;
+}
+
+
+int JPEGDecoder::decodeRegion(int x, int y, int w, int h) {
+
+	if (!pImage) return 0; // No image open
+
+	setClipRect(x, y, w, h);
+	setClipMCUs();
+
+	uint32_t mcu = (uint32_t)mcu_y * MCUSPerRow + mcu_x; // Already decoded, if there was one
+	uint32_t target = (uint32_t)clip_mcu_y0 * MCUSPerRow + clip_mcu_x0;
+
+	if (clip_mcu_y1 < 0) {
+		is_available = 0;
+		return 1;
+	}
+
+	if (is_available && mcu == target) return 1;
+
+	// After an error the stream can only be picked up again at a restart interval
+	if (!is_available && status != PJPG_NO_MORE_BLOCKS) mcu = (uint32_t)-1;
+
+	if (restart_intervals && (target < mcu || target / image_info.m_restartInterval > mcu / image_info.m_restartInterval)) {
+		if (seekInterval(target / image_info.m_restartInterval)) return 0;
+	}
+	else if (target >= mcu && mcu < (uint32_t)MCUSPerRow * MCUSPerCol) {
+		// Skip forward from the MCU after the decoded one, or from the one after the
+		// last clip rectangle which hasn't been decoded yet
+		if (is_available) {
+			mcu_x++;
+			if (mcu_x == MCUSPerRow) {
+				mcu_x = 0;
+				mcu_y++;
+			}
+		}
+	}
+	else return 0; // Can't go back without an index
+
+	is_available = 1;
+
+	return decode_mcu() == 1 && status == 0;
+}
+
+
+// EXIF values are in the byte order given at the start of its TIFF header
+static uint32_t getExif(const uint8_t *p, uint8_t n, uint8_t big) {
+	uint32_t v = 0;
+	if (!big) return getLE(p, n);
+	while (n--) v = (v << 8) | *p++;
+	return v;
+}
+
+
+// Finds the JPEG thumbnail in the image's EXIF segment (IFD1), returns 1 with its offset
+// and length in the source if there is one
+int JPEGDecoder::findThumbnail(uint32_t *pOfs, uint32_t *pLen) {
+
+	uint8_t buf[12];
+	uint32_t ofs = 2, len = 0;
+
+	if (readSource(0, buf, 2) != 2 || buf[0] != 0xFF || buf[1] != 0xD8) return 0;
+
+	// It's in an APP1 segment amongst the APPn and COM segments at the start
+	for (;;) {
+		if (readSource(ofs, buf, 10) != 10 || buf[0] != 0xFF) return 0;
+
+		if (buf[1] == 0xFF) { ofs++; continue; } // Fill byte
+		if ((buf[1] & 0xF0) != 0xE0 && buf[1] != 0xFE) return 0;
+
+		len = (buf[2] << 8) | buf[3];
+		if (buf[1] == 0xE1 && len >= 16 && !memcmp(buf + 4, "Exif\0\0", 6)) break;
+
+		ofs += 2 + len;
+	}
+
+	uint32_t tiff = ofs + 10;        // Offsets in the EXIF data are from its TIFF header
+	uint32_t end = ofs + 2 + len - tiff; // and must be within the segment
+
+	if (readSource(tiff, buf, 8) != 8 || buf[0] != buf[1] || (buf[0] != 'I' && buf[0] != 'M')) return 0;
+
+	uint8_t big = buf[0] == 'M';
+	uint32_t ifd = getExif(buf + 4, 4, big);
+
+	// IFD1, which describes the thumbnail, follows IFD0
+	if (ifd > end - 2 || readSource(tiff + ifd, buf, 2) != 2) return 0;
+
+	ifd += 2 + 12 * getExif(buf, 2, big);
+	if (ifd > end - 4 || readSource(tiff + ifd, buf, 4) != 4) return 0;
+
+	ifd = getExif(buf, 4, big);
+	if (!ifd || ifd > end - 2 || readSource(tiff + ifd, buf, 2) != 2) return 0;
+
+	uint32_t entries = getExif(buf, 2, big), compression = 6, thumb_ofs = 0, thumb_len = 0;
+
+	for (ifd += 2; entries-- && ifd <= end - 12; ifd += 12) {
+		if (readSource(tiff + ifd, buf, 12) != 12) return 0;
+
+		uint32_t tag = getExif(buf, 2, big);
+		uint32_t value = getExif(buf + 8, getExif(buf + 2, 2, big) == 3 ? 2 : 4, big); // SHORT or LONG
+
+		if (tag == 0x0103) compression = value;
+		else if (tag == 0x0201) thumb_ofs = value; // JPEGInterchangeFormat
+		else if (tag == 0x0202) thumb_len = value; // JPEGInterchangeFormatLength
+	}
+
+	// Compression 1 is an uncompressed TIFF thumbnail
+	if (compression != 6 || !thumb_ofs || !thumb_len || thumb_ofs > end || thumb_len > end - thumb_ofs) return 0;
+
+	*pOfs = tiff + thumb_ofs;
+	*pLen = thumb_len;
+	return 1;
+}
+
+
+// Moves the source on to the EXIF thumbnail if there is one of at least thumb_w x thumb_h,
+// returns 1 if it did. The source is left at the start of the image decoded either way.
+int JPEGDecoder::selectThumbnail(void) {
+
+	uint32_t ofs, len, size = g_nInFileSize;
+
+	if (!findThumbnail(&ofs, &len) || !seekSource(ofs)) {
+		seekSource(0);
+		return 0;
+	}
+
+	// Offsets are from the start of the thumbnail while it is being decoded
+	jpg_base = ofs;
+	g_nInFileOfs = 0;
+	g_nInFileSize = len;
+
+#ifdef JPEG_ARRAY_IN_PLACE
+	if (jpg_source == JPEG_ARRAY)
+		status = pjpeg_probe_mem_ctx(&pjpeg_ctx, &image_info, jpg_data, g_nInFileSize);
+	else
+#endif
+	status = pjpeg_probe_ctx(&pjpeg_ctx, &image_info, pjpeg_callback, pjpeg_skip_callback, this);
+
+	if (!status && image_info.m_width >= thumb_w && image_info.m_height >= thumb_h && seekSource(0)) return 1;
+
+	// Back to the image itself
+	if (jpg_source == JPEG_ARRAY) jpg_data -= jpg_base + g_nInFileOfs;
+	jpg_base = 0;
+	g_nInFileOfs = 0;
+	g_nInFileSize = size;
+	seekSource(0);
+
+	return 0;
+}
+
+
+void JPEGDecoder::setKeepTables(bool on) {
+
+	keep_tables = on;
+	tables_valid = 0; // pjpeg_ctx may not have decoded an image yet
+}
+
+
+void JPEGDecoder::setMjpeg(bool on) {
+
+	abort(); // Releases pImage if it is mjpeg_image
+
+	if (mjpeg_image) delete[] mjpeg_image;
+	mjpeg_image = NULL;
+
+	mjpeg = on;
+	tables_valid = 0;
+	mjpeg_frames = 0;
+	mjpeg_fps = 0;
+	mjpeg_fps_frames = 0;
+	mjpeg_fps_ms = millis();
+}
+
+
+// Counts a frame and updates the frame rate about once a second
+void JPEGDecoder::countMjpegFrame(void) {
+
+	unsigned long ms = millis() - mjpeg_fps_ms;
+
+	mjpeg_frames++;
+
+	if (ms >= 1000) {
+		mjpeg_fps = (mjpeg_frames - mjpeg_fps_frames) * 1000.0f / ms;
+		mjpeg_fps_frames = mjpeg_frames;
+		mjpeg_fps_ms += ms;
+	}
+}
+
+
+uint32_t JPEGDecoder::getMjpegFrames(void) {
+
+	return mjpeg_frames;
+}
+
+
+float JPEGDecoder::getMjpegFps(void) {
+
+	return mjpeg_fps;
+}
+
+
+uint32_t JPEGDecoder::mjpegFrameSize(const uint8_t *pData, uint32_t size) {
+
+	uint32_t ofs = 2;
+
+	if (size < 4 || pData[0] != 0xFF || pData[1] != 0xD8) return 0;
+
+	while (ofs + 2 <= size) {
+		if (pData[ofs] != 0xFF) return 0;
+
+		uint8_t marker = pData[ofs + 1];
+		if (marker == 0xFF) { ofs++; continue; } // Fill byte
+		if (marker == 0xD9) return ofs + 2;      // EOI
+
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { ofs += 2; continue; }
+
+		if (ofs + 4 > size) return 0;
+		ofs += 2 + ((pData[ofs + 2] << 8) | pData[ofs + 3]);
+
+		if (marker != 0xDA) continue;
+
+		// Entropy coded data (and RSTn markers) runs up to the next other marker
+		while (ofs + 1 < size && (pData[ofs] != 0xFF || pData[ofs + 1] == 0x00 ||
+		       pData[ofs + 1] == 0xFF || (pData[ofs + 1] >= 0xD0 && pData[ofs + 1] <= 0xD7)))
+			ofs++;
+	}
+
+	return 0;
+}
+
+
+void JPEGDecoder::setThumbnailSize(int w, int h) {
+
+	thumb_w = w;
+	thumb_h = h;
+}
+
+
+void JPEGDecoder::setFancyUpsampling(bool fancy) {
+
+	upsampling = fancy ? PJPG_UPSAMPLE_FANCY : PJPG_UPSAMPLE_BOX;
+}
+
+
+#if PJPG_STATS
+const pjpeg_stats_t *JPEGDecoder::getStats(void) {
+
+	return &pjpeg_ctx.mStats;
+}
+#endif
+
+
+void JPEGDecoder::setScale(uint8_t scale) {
+
+	switch (scale) {
+		case 2:  scale_shift = 1; break;
+		case 4:  scale_shift = 2; break;
+		case 8:  scale_shift = 3; break;
+		default: scale_shift = 0; break;
+	}
+}
+
+
+// Maps the scale_shift set by setScale() to picojpeg's reduce modes
+static const uint8 reduce_modes[4] = { PJPG_REDUCE_NONE, PJPG_REDUCE_1_2, PJPG_REDUCE_1_4, PJPG_REDUCE_1_8 };
+
+// Sets the public image info from image_info, scaled down by scale_shift
+void JPEGDecoder::setScaledInfo(void) {
+
+	width = (image_info.m_width + (1 << scale_shift) - 1) >> scale_shift;
+	height = (image_info.m_height + (1 << scale_shift) - 1) >> scale_shift;
+	comps = image_info.m_comps;
+	MCUSPerRow = image_info.m_MCUSPerRow;
+	MCUSPerCol = image_info.m_MCUSPerCol;
+	scanType = image_info.m_scanType;
+	MCUWidth = image_info.m_MCUWidth >> scale_shift;
+	MCUHeight = image_info.m_MCUHeight >> scale_shift;
+	progressive = image_info.m_progressive;
+	coeffBufSize = image_info.m_coeffBufSize;
+}
+
+
+#ifdef JPEG_PARALLEL_DECODE
+
+// Returns the offset of the first entropy coded byte after the SOS header, or 0
+static uint32_t findScanData(const uint8_t *pData, uint32_t size) {
+	uint32_t ofs = 2;
+
+	if (size < 4 || pData[0] != 0xFF || pData[1] != 0xD8) return 0;
+
+	while (ofs + 4 <= size) {
+		if (pData[ofs] != 0xFF) return 0;
+
+		uint8_t marker = pData[ofs + 1];
+		if (marker == 0xFF) { ofs++; continue; } // Fill byte
+
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) { ofs += 2; continue; }
+
+		uint32_t len = (pData[ofs + 2] << 8) | pData[ofs + 3];
+		ofs += 2 + len;
+
+		if (marker == 0xDA) return (ofs < size) ? ofs : 0;
+	}
+
+	return 0;
+}
+
+int JPEGDecoder::decodeArrayParallel(const uint8_t array[], uint32_t array_size, uint16_t *pOutput, uint32_t output_size, int threads) {
+
+	abort();
+
+	status = pjpeg_decode_init_mem_ctx(&pjpeg_ctx, &image_info, array, array_size, reduce_modes[scale_shift]);
+
+	if (status) {
+		#ifdef DEBUG
+		Serial.print("pjpeg_decode_init() failed with status ");
+		Serial.println(status);
+		#endif
+
+		return 0;
+	}
+
+	pjpeg_set_output_ctx(&pjpeg_ctx, PJPG_OUTPUT_YCBCR);
+	pjpeg_set_upsampling_ctx(&pjpeg_ctx, upsampling);
+
+	setScaledInfo();
+
+	if ((uint32_t)width * height > output_size) return 0;
+
+	// Progressive scans are decoded up front, then output sequentially below
+	if (progressive && !decodeScans()) return 0;
+
+	uint32_t totalMCUs = (uint32_t)MCUSPerRow * MCUSPerCol;
+	uint32_t intervalMCUs = image_info.m_restartInterval;
+	uint32_t intervals = intervalMCUs ? (totalMCUs + intervalMCUs - 1) / intervalMCUs : 1;
+	uint32_t *pOffsets = NULL;
+
+	// Pre-scan the entropy coded data for the RSTn markers that start each interval
+	if (intervals > 1 && threads > 1 && !progressive) {
+		uint32_t ofs = findScanData(array, array_size);
+		uint32_t found = 1;
+
+		if (ofs) {
+			pOffsets = new uint32_t[intervals];
+			pOffsets[0] = ofs;
+
+			while (ofs + 1 < array_size && found < intervals) {
+				if (array[ofs] == 0xFF && array[ofs + 1] >= 0xD0 && array[ofs + 1] <= 0xD7) {
+					ofs += 2;
+					pOffsets[found++] = ofs;
+				}
+				else ofs++;
+			}
+		}
+
+		// Corrupt or unexpected layout, decode it sequentially instead
+		if (found != intervals) {
+			delete[] pOffsets;
+			pOffsets = NULL;
+		}
+	}
+
+	// Sequential decode, no restart markers or no other threads to share with
+	if (pOffsets == NULL) {
+		for (uint32_t mcu = 0; mcu < totalMCUs; mcu++) {
+			status = pjpeg_decode_mcu_ctx(&pjpeg_ctx);
+			if (status) break;
+
+			int mx = mcu % MCUSPerRow, my = mcu / MCUSPerRow;
+			copyMCU(&pjpeg_ctx, &image_info, mx, my, pOutput + (my * MCUHeight * width) + mx * MCUWidth, width, scale_shift, SWAP_PIXELS);
+		}
+
+		abort(); // Frees any progressive coefficients
+		return status ? -1 : 1;
+	}
+
+	if ((uint32_t)threads > intervals) threads = intervals;
+
+	std::atomic<uint32_t> nextInterval(0);
+	std::atomic<int> failed(0);
+	pjpeg_context_t *pContexts = new pjpeg_context_t[threads];
+
+	// Each worker takes the next undecoded interval until there are none left
+	auto worker = [&](pjpeg_context_t *pCtx) {
+		const pjpeg_context_t *pHeaderCtx = &pjpeg_ctx; // Tables are only copied once per worker
+
+		for (;;) {
+			uint32_t interval = nextInterval++;
+			if (interval >= intervals || failed) break;
+
+			if (pjpeg_decode_interval_init_mem_ctx(pCtx, pHeaderCtx, interval, array + pOffsets[interval], array_size - pOffsets[interval])) {
+				failed = 1;
+				break;
+			}
+			pHeaderCtx = pCtx;
+
+			uint32_t mcu = interval * intervalMCUs;
+			uint32_t last = jpg_min(mcu + intervalMCUs, totalMCUs);
+
+			for ( ; mcu < last; mcu++) {
+				if (pjpeg_decode_mcu_ctx(pCtx)) {
+					failed = 1;
+					break;
+				}
+
+				int mx = mcu % MCUSPerRow, my = mcu / MCUSPerRow;
+				copyMCU(pCtx, &image_info, mx, my, pOutput + (my * MCUHeight * width) + mx * MCUWidth, width, scale_shift, SWAP_PIXELS);
+			}
+		}
+	};
+
+	std::thread *pThreads = new std::thread[threads - 1];
+	for (int i = 0; i < threads - 1; i++) pThreads[i] = std::thread(worker, &pContexts[i + 1]);
+
+	worker(&pContexts[0]);
+
+	for (int i = 0; i < threads - 1; i++) pThreads[i].join();
+
+	delete[] pThreads;
+	delete[] pContexts;
+	delete[] pOffsets;
+
+	return failed ? -1 : 1;
+}
+#endif
+
+
+// Decodes all the scans of a progressive image into the coefficient buffer,
+// returns 1 on success. MCU's are then read out of it as usual.
+int JPEGDecoder::decodeScans(void) {
+
+	int16_t *pCoeffs = user_coeffs;
+
+	if (!pCoeffs) {
+		heap_coeffs = new int16_t[(coeffBufSize + 1) / 2];
+		pCoeffs = heap_coeffs;
+	}
+	else if (user_coeffs_size < coeffBufSize) {
+		#ifdef DEBUG
+		Serial.println("ERROR: Coefficient buffer is too small for the progressive image!");
+		#endif
+
+		return 0;
+	}
+
+	status = pjpeg_decode_scans_ctx(&pjpeg_ctx, (short *)pCoeffs, pCoeffs == user_coeffs ? user_coeffs_size : coeffBufSize, max_scans);
+
+	if (status) {
+		#ifdef DEBUG
+		Serial.print("pjpeg_decode_scans() failed with status ");
+		Serial.println(status);
+		#endif
+
+		return 0;
+	}
+
+	return 1;
+}
+
+
 int JPEGDecoder::decodeCommon(void) {
 
 	width = 0;
@@ -419,7 +1229,45 @@ int JPEGDecoder::decodeCommon(void) {
 	MCUWidth = 0;
 	MCUHeight = 0;
 
-	status = pjpeg_decode_init(&image_info, pjpeg_callback, NULL, 0);
+	jpg_base = 0;
+	thumbnail = (thumb_w || thumb_h) && selectThumbnail();
+
+	if (probe_only) {
+#ifdef JPEG_ARRAY_IN_PLACE
+		if (jpg_source == JPEG_ARRAY)
+			status = pjpeg_probe_mem_ctx(&pjpeg_ctx, &image_info, jpg_data, g_nInFileSize);
+		else
+#endif
+		status = pjpeg_probe_ctx(&pjpeg_ctx, &image_info, pjpeg_callback, pjpeg_skip_callback, this);
+
+		abort(); // Closes the file, there's nothing to read
+
+		if (status) {
+			#ifdef DEBUG
+			Serial.print("pjpeg_probe() failed with status ");
+			Serial.println(status);
+			#endif
+
+			return 0;
+		}
+
+		setScaledInfo();
+		return 1;
+	}
+
+	// MJPEG frames keep the tables of the frame before, many don't define all of them
+	uint8 reduce = reduce_modes[scale_shift] | (tables_valid ? PJPG_KEEP_TABLES : 0);
+
+	if (mjpeg) countMjpegFrame();
+
+#ifdef JPEG_ARRAY_IN_PLACE
+	if (jpg_source == JPEG_ARRAY) // No need to copy the array through the callback
+		status = pjpeg_decode_init_mem_ctx(&pjpeg_ctx, &image_info, jpg_data, g_nInFileSize, reduce);
+	else
+#endif
+	status = pjpeg_decode_init_ctx(&pjpeg_ctx, &image_info, pjpeg_callback, pjpeg_skip_callback, this, reduce);
+
+	tables_valid = !status && (mjpeg || keep_tables); // Only tables from headers that were read without error are kept
 
 	if (status) {
 		#ifdef DEBUG
@@ -434,28 +1282,44 @@ int JPEGDecoder::decodeCommon(void) {
 		return 0;
 	}
 
-	decoded_width =  image_info.m_width;
-	decoded_height =  image_info.m_height;
+	pjpeg_set_output_ctx(&pjpeg_ctx, PJPG_OUTPUT_YCBCR); // RGB565 is made by copyMCU()
+	pjpeg_set_upsampling_ctx(&pjpeg_ctx, upsampling);
+
+	setScaledInfo();
+	setClipMCUs();
+	restart_intervals = checkRestartIndex();
+
+	if (progressive && !decodeScans()) return 0;
+
+	decoded_width =  width;
+	decoded_height =  height;
 	
-	row_pitch = image_info.m_MCUWidth;
-	pImage = new uint16_t[image_info.m_MCUWidth * image_info.m_MCUHeight];
+	row_pitch = MCUWidth;
+
+	if (user_image) {
+		if (user_image_size < (uint32_t)MCUWidth * MCUHeight) {
+			#ifdef DEBUG
+			Serial.println("ERROR: Output buffer is too small for the MCU!");
+			#endif
+
+			return 0;
+		}
+		pImage = user_image;
+	}
+	else if (mjpeg) {
+		// Big enough for any frame's MCU's, kept until setMjpeg(false)
+		if (!mjpeg_image) mjpeg_image = new uint16_t[16 * 16];
+		pImage = mjpeg_image;
+	}
+	else pImage = new uint16_t[MCUWidth * MCUHeight];
 
-	memset(pImage , 0 , image_info.m_MCUWidth * image_info.m_MCUHeight * sizeof(*pImage));
+	memset(pImage , 0 , MCUWidth * MCUHeight * sizeof(*pImage));
 
 	row_blocks_per_mcu = image_info.m_MCUWidth >> 3;
 	col_blocks_per_mcu = image_info.m_MCUHeight >> 3;
 
 	is_available = 1 ;
 
-	width = decoded_width;
-	height = decoded_height;
-	comps = 1;
-	MCUSPerRow = image_info.m_MCUSPerRow;
-	MCUSPerCol = image_info.m_MCUSPerCol;
-	scanType = image_info.m_scanType;
-	MCUWidth = image_info.m_MCUWidth;
-	MCUHeight = image_info.m_MCUHeight;
-
 	return decode_mcu();
 }
 
@@ -464,8 +1328,10 @@ void JPEGDecoder::abort(void) {
 	mcu_x = 0 ;
 	mcu_y = 0 ;
 	is_available = 0;
-	if(pImage) delete[] pImage;
+	if(pImage && pImage != user_image && pImage != mjpeg_image) delete[] pImage;
 	pImage = NULL;
+	if(heap_coeffs) delete[] heap_coeffs;
+	heap_coeffs = NULL;
 	
 #ifdef LOAD_FLASH_FS
 	if (jpg_source == JPEG_FS_FILE) if (g_pInFileFs) g_pInFileFs.close();
@@ -474,4 +1340,9 @@ void JPEGDecoder::abort(void) {
 #if defined (LOAD_SD_LIBRARY) || defined (LOAD_SDFAT_LIBRARY)
 	if (jpg_source == JPEG_SD_FILE) if (g_pInFileSd) g_pInFileSd.close();
 #endif
+
+#ifdef LOAD_POSIX_FILE
+	if (g_nInFileFd >= 0) close(g_nInFileFd);
+	g_nInFileFd = -1;
+#endif
 }
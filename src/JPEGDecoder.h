@@ -19,7 +19,11 @@ https://github.com/Bodmer/JPEGDecoder
     #include "User_Config.h"
   #endif // JPEGDECODER_SETUP_LOADED
 
-  #include "Arduino.h"
+  #ifdef ARDUINO
+    #include "Arduino.h"
+  #else
+    #include "JPEGDecoder_Host.h" // Native build on a PC
+  #endif
 
   #ifdef __AVR__
     #include <avr/pgmspace.h>
@@ -54,6 +58,16 @@ https://github.com/Bodmer/JPEGDecoder
     #define TJPGD_LOAD_FFS
   #endif
 
+  // Arrays are decoded in place unless the processor needs pgm_read_byte() to
+  // read them, AVR flash is a separate address space and ESP8266 flash must be
+  // read as aligned 32 bit words
+  #if !defined (__AVR__) && !defined (ARDUINO_ARCH_ESP8266)
+    #define JPEG_ARRAY_IN_PLACE
+    #ifndef memcpy_P
+      #define memcpy_P memcpy // Arrays are directly addressable here
+    #endif
+  #endif
+
   #if defined (LOAD_SD_LIBRARY) || defined (LOAD_SDFAT_LIBRARY)
     #ifdef LOAD_SDFAT_LIBRARY
       #include <SdFat.h> // Alternative where we might need to bit bash the SPI
@@ -68,15 +82,25 @@ https://github.com/Bodmer/JPEGDecoder
 enum {
   JPEG_ARRAY = 0,
   JPEG_FS_FILE,
-  JPEG_SD_FILE
+  JPEG_SD_FILE,
+  JPEG_POSIX_FILE
 };
 
 //#define DEBUG
 
+#ifdef SWAP_BYTES
+  #define SWAP_PIXELS 1 // read() returns byte swapped pixels, see User_Config.h
+#else
+  #define SWAP_PIXELS 0
+#endif
+
 //------------------------------------------------------------------------------
 #ifndef jpg_min
   #define jpg_min(a,b) (((a) < (b)) ? (a) : (b))
 #endif
+#ifndef jpg_max
+  #define jpg_max(a,b) (((a) > (b)) ? (a) : (b))
+#endif
 
 //------------------------------------------------------------------------------
 typedef unsigned char uint8;
@@ -91,9 +115,13 @@ private:
 #endif
 #ifdef LOAD_FLASH_FS
   fs::File g_pInFileFs;
+#endif
+#ifdef LOAD_POSIX_FILE
+  int g_nInFileFd = -1;
 #endif
   pjpeg_scan_type_t scan_type;
   pjpeg_image_info_t image_info;
+  pjpeg_context_t pjpeg_ctx; // All picojpeg decoder state for this instance
   
   int is_available;
   int mcu_x;
@@ -105,12 +133,47 @@ private:
   uint row_blocks_per_mcu, col_blocks_per_mcu;
   uint8 status;
   uint8 jpg_source = 0;
+  uint8 scale_shift = 0; // log2 of the scale set by setScale()
+  uint16_t *user_image = NULL; // MCU buffer set by setOutputBuffer(), never freed here
+  uint32_t user_image_size = 0;
+  int16_t *user_coeffs = NULL; // Progressive coefficient buffer set by setCoeffBuffer()
+  uint32_t user_coeffs_size = 0;
+  int16_t *heap_coeffs = NULL; // or allocated per image when there isn't one
+  uint8 max_scans = 0;
+  uint8 upsampling = PJPG_UPSAMPLE_BOX; // Set by setFancyUpsampling()
+  int clip_x = 0, clip_y = 0, clip_w = 0, clip_h = 0; // Set by setClipRect()
+  int clip_mcu_x0 = 0, clip_mcu_y0 = 0, clip_mcu_x1 = 0, clip_mcu_y1 = 0; // and the MCU's it covers
+  const uint8_t *restart_index = NULL; // Set by setRestartIndex()
+  uint32_t restart_index_size = 0;
+  uint32_t restart_intervals = 0; // Intervals in the index if it's for the current image
+  uint8 probe_only = 0; // Set by probeFile() and probeArray()
+  int thumb_w = 0, thumb_h = 0; // Set by setThumbnailSize()
+  uint32_t jpg_base = 0; // Offset in a file of the image being decoded, of its EXIF thumbnail
+  uint8 mjpeg = 0;        // Set by setMjpeg()
+  uint8 keep_tables = 0;  // Set by setKeepTables()
+  uint8 tables_valid = 0; // pjpeg_ctx holds the tables of the last image
+  uint16_t *mjpeg_image = NULL; // pImage for every frame
+  uint32_t mjpeg_frames = 0, mjpeg_fps_frames = 0;
+  unsigned long mjpeg_fps_ms = 0;
+  float mjpeg_fps = 0;
   uint8_t* jpg_data;
   
-  static uint8 pjpeg_callback(unsigned char* pBuf, unsigned char buf_size, unsigned char *pBytes_actually_read, void *pCallback_data);
-  uint8 pjpeg_need_bytes_callback(unsigned char* pBuf, unsigned char buf_size, unsigned char *pBytes_actually_read, void *pCallback_data);
+  static uint8 pjpeg_callback(unsigned char* pBuf, pjpeg_size_t buf_size, pjpeg_size_t *pBytes_actually_read, void *pCallback_data);
+  static uint8 pjpeg_skip_callback(unsigned long n, void *pCallback_data);
+  uint8 pjpeg_need_bytes_callback(unsigned char* pBuf, pjpeg_size_t buf_size, pjpeg_size_t *pBytes_actually_read, void *pCallback_data);
   int decode_mcu(void);
   int decodeCommon(void);
+  static void copyMCU(const pjpeg_context_t *pCtx, const pjpeg_image_info_t *pInfo, int mcuX, int mcuY, uint16_t *pDst_row, uint pitch, uint8 shift, uint8 swap);
+  void setScaledInfo(void);
+  void setClipMCUs(void);
+  int seekSource(uint32_t ofs);
+  uint32_t readSource(uint32_t ofs, uint8_t *pBuf, uint32_t n);
+  uint32_t checkRestartIndex(void);
+  uint8 seekInterval(uint32_t interval);
+  int findThumbnail(uint32_t *pOfs, uint32_t *pLen);
+  int selectThumbnail(void);
+  void countMjpegFrame(void);
+  int decodeScans(void);
 public:
 
   uint16_t *pImage;
@@ -126,6 +189,9 @@ public:
   int MCUHeight;
   int MCUx;
   int MCUy;
+  int progressive;       // 1 for progressive images
+  int thumbnail;         // 1 when the EXIF thumbnail is decoded, see setThumbnailSize()
+  uint32_t coeffBufSize; // Bytes of coefficient buffer a progressive image needs
   
   JPEGDecoder();
   ~JPEGDecoder();
@@ -133,6 +199,12 @@ public:
   int available(void);
   int read(void);
   int readSwappedBytes(void);
+
+  // Decodes the next full row of MCU's into pBand as a width x MCUHeight strip of
+  // RGB565 pixels, band_size is the capacity of pBand in pixels. Returns the number
+  // of image rows in the band (less than MCUHeight for the last band) or 0 when there
+  // are no more. MCUy is set to the MCU row of the band.
+  int readBand(uint16_t *pBand, uint32_t band_size);
   
   int decodeFile (const char *pFilename);
   int decodeFile (const String& pFilename);
@@ -149,11 +221,124 @@ public:
   int decodeFsFile (fs::File g_pInFile);
 #endif
 
+#ifdef LOAD_POSIX_FILE
+  int decodePosixFile (int fd); // Reads from fd and closes it when done
+#endif
+
   int decodeArray(const uint8_t array[], uint32_t  array_size);
+  int decodeArray(const uint8_t array[], uint32_t  array_size, uint8_t scale);
+
+  // Read only the headers of an image up to its frame (SOF) header and set width, height,
+  // comps, scanType, MCUWidth, MCUHeight, MCUSPerRow, MCUSPerCol, progressive and
+  // coeffBufSize as decodeFile() or decodeArray() would (scaled by setScale()). No memory
+  // is allocated and nothing is decoded, the file is closed again and read() returns 0.
+  // Returns 1 on success.
+  int probeFile (const char *pFilename);
+  int probeFile (const String& pFilename);
+  int probeArray(const uint8_t array[], uint32_t  array_size);
+
+  // Use pBuffer (size pixels, at least MCUWidth x MCUHeight) as pImage for subsequent
+  // decodes instead of allocating one on the heap per image. The decoder's other state
+  // is held in the JPEGDecoder object, so no heap is used at all. NULL reverts to new[].
+  void setOutputBuffer(uint16_t *pBuffer, uint32_t size);
+
+  // Progressive images are decoded into a coefficient buffer of coeffBufSize bytes
+  // (128 bytes per 8x8 block) before any MCU's can be read. By default it is allocated
+  // on the heap for each image, or pBuffer (size bytes) is used if set here. A decode
+  // fails if the buffer is too small, coeffBufSize is still set so it can be retried.
+  void setCoeffBuffer(int16_t *pBuffer, uint32_t size);
+
+  // Only decode the first scans of a progressive image, for a quick lower quality
+  // preview. 0 decodes them all.
+  void setMaxScans(uint8_t scans);
+
+  // Smooth the colour of subsequent images with a triangle filter when their chroma is
+  // subsampled (most camera and web images), instead of repeating each chroma sample
+  // over 2 or 4 pixels which shows as colour blocks at sharp edges. It costs a little
+  // speed, the default is off.
+  void setFancyUpsampling(bool fancy);
+
+  // Decode the JPEG thumbnail that cameras and phones put in the EXIF (APP1) segment of
+  // subsequent images instead of the image itself, if it is at least w x h pixels (before
+  // setScale()). A gallery grid can then decode a 160x120 thumbnail rather than a multi
+  // megapixel photo. thumbnail is 1 when it is used, width, height etc. are then those of
+  // the thumbnail. probeFile() and probeArray() use it too. 0, 0 turns it off (the default).
+  // Not used by decodeArrayParallel().
+  void setThumbnailSize(int w, int h);
+
+  // Keep the Huffman and quantization tables of each image for the next, for images that leave
+  // out the tables they share (abbreviated JPEG streams) or repeat the same ones, such as map
+  // tiles from one encoder: tables defined the same as the last image's aren't built again.
+  void setKeepTables(bool on);
+
+  // Decode subsequent images as the frames of an MJPEG stream (JPEG images one after another,
+  // as sent by IP cameras or stored in AVI files). Tables a frame doesn't define are kept from
+  // the frame before, or are the standard Huffman tables from the JPEG spec if no frame has
+  // defined them (AVI frames leave them out), and pImage is allocated once for all the frames.
+  // Frames are decoded with decodeArray() etc. as usual, mjpegFrameSize() splits up a buffer
+  // of them. setMjpeg(false) (the default) frees pImage again.
+  void setMjpeg(bool on);
+
+  // Returns the size of the JPEG frame at the start of pData (up to and including its EOI
+  // marker) or 0 if size bytes don't hold all of it.
+  static uint32_t mjpegFrameSize(const uint8_t *pData, uint32_t size);
+
+  // Frames started since setMjpeg(true), and the frame rate over about the last second
+  uint32_t getMjpegFrames(void);
+  float getMjpegFps(void);
+
+  // Only decode the MCU's of subsequent images that overlap the rectangle x, y, w, h (in
+  // pixels of the scaled image, it may extend past its edges). read(), readSwappedBytes()
+  // and readBand() then skip the others, so MCUx and MCUy must be used to place each one,
+  // and stop after the rectangle's last MCU row (readBand() leaves the skipped MCU's part
+  // of the band as it was). Skipped MCU's are still Huffman decoded but nothing else is
+  // done with them. A w or h of 0 decodes the whole image again.
+  // Not used by decodeArrayParallel().
+  void setClipRect(int x, int y, int w, int h);
+
+  // Images with restart markers (DRI) can be decoded from the start of any restart interval.
+  // buildRestartIndex() finds where each interval starts in the image just opened with
+  // decodeArray() or decodeFile() etc. and writes them to pBlob as an index of blob_size
+  // bytes, which may be saved in a sidecar file. It returns the index size, without writing
+  // it if pBlob is NULL or too small, or 0 if the image has no restart markers. The image
+  // is closed afterwards and must be opened again to be read.
+  uint32_t buildRestartIndex(uint8_t *pBlob, uint32_t blob_size);
+
+  // Use an index made by buildRestartIndex() (kept by the caller) for subsequent images,
+  // it is ignored for images it wasn't made for. MCU's before and beside a setClipRect()
+  // rectangle are then passed over by seeking instead of being Huffman decoded.
+  void setRestartIndex(const uint8_t *pBlob, uint32_t blob_size);
+
+  // Moves the image being read (after decodeArray() etc. and before read() etc. return 0)
+  // on to a new rectangle as setClipRect() does, read() etc. then return its MCU's. With a
+  // restart index for the image it can be any rectangle, else only one further on. Returns
+  // 1 on success. Array, SD, LittleFS and host files can be seeked.
+  int decodeRegion(int x, int y, int w, int h);
+
+#if PJPG_STATS
+  // Time spent in each stage of decoding the current image and a few counts, see
+  // PJPG_STATS in picojpeg.h. m_outputTicks is the RGB565 packing in read() etc.
+  const pjpeg_stats_t *getStats(void);
+#endif
+
+  // Decode subsequent images at 1/scale of their size, scale is 1, 2, 4 or 8.
+  // width, height, MCUWidth and MCUHeight are then those of the scaled image.
+  void setScale(uint8_t scale);
+
+#ifdef JPEG_PARALLEL_DECODE
+  // Decodes the whole image into pOutput (width x height RGB565 pixels, output_size is
+  // the capacity of pOutput in pixels). Images with restart markers are split at the
+  // markers and the intervals shared between up to 'threads' threads (including the
+  // caller), others are decoded by the caller alone. Returns 1 on success.
+  int decodeArrayParallel(const uint8_t array[], uint32_t array_size, uint16_t *pOutput, uint32_t output_size, int threads);
+#endif
+
   void abort(void);
 
 };
 
+// The decoder most sketches use. More JPEGDecoder objects can be created to decode several
+// images at once (from different tasks or cores too), each keeps all of its own state.
 extern JPEGDecoder JpegDec;
 
 #endif // JPEGDECODER_H
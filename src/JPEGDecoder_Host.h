@@ -0,0 +1,47 @@
+/*
+JPEGDecoder_Host.h
+
+Stands in for the parts of the Arduino core used by JPEGDecoder so that the library
+can be built and profiled natively on a PC (Linux or any other POSIX system), see
+CMakeLists.txt in the library folder. Arrays are decoded as usual and files are
+read with the POSIX open() and read() calls by decodeFile().
+
+It is only included by JPEGDecoder.h when ARDUINO is not defined.
+*/
+
+#ifndef JPEGDECODER_HOST_H
+  #define JPEGDECODER_HOST_H
+
+  #include <stdint.h>
+  #include <stdio.h>
+  #include <string.h>
+  #include <string>
+  #include <chrono>
+
+  // The SD and flash filing systems are replaced by the host's
+  #undef LOAD_SD_LIBRARY
+  #undef LOAD_SDFAT_LIBRARY
+  #define LOAD_POSIX_FILE
+
+  #define PROGMEM
+
+  typedef std::string String;
+
+  // Milliseconds from the first call, for the MJPEG frame rate
+  inline unsigned long millis(void) {
+    static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Enough of Serial for the DEBUG messages
+  class JPEGHostSerial {
+  public:
+    void print(const char *s) { fputs(s, stdout); }
+    void print(int n)         { printf("%d", n); }
+    void println(const char *s) { puts(s); }
+    void println(int n)         { printf("%d\n", n); }
+  };
+
+  static JPEGHostSerial Serial __attribute__((unused));
+
+#endif // JPEGDECODER_HOST_H
@@ -5,6 +5,11 @@
 #define LOAD_SD_LIBRARY // Default SD Card library
 //#define LOAD_SDFAT_LIBRARY // Use SdFat library instead, so SD Card SPI can be bit bashed
 
+// Uncomment the next #define to add decodeArrayParallel(), this decodes a whole image
+// held in memory into a frame buffer and shares the work between several threads when
+// the Jpeg has restart markers. Needs C++ std::thread support (e.g. ESP32).
+//#define JPEG_PARALLEL_DECODE
+
 
 // Note for ESP8266 users:
 // If the sketch uses SPIFFS and has included FS.h without defining FS_NO_GLOBALS first
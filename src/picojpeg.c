@@ -19,6 +19,32 @@ typedef unsigned short  uint16;
 typedef signed char     int8;
 typedef signed short    int16;
 //------------------------------------------------------------------------------
+#if PJPG_STATS
+  #include <string.h> // memset()
+  #ifdef ARDUINO
+    #include <Arduino.h> // micros()
+  #else
+    #include <time.h>
+
+unsigned long pjpeg_stats_clock(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+  #endif
+
+  // PJPG_STATS_START() declares a tick count, PJPG_STATS_LAP() adds the ticks since
+  // then to a pjpeg_stats_t member and restarts the count.
+  #define PJPG_STATS_START(t)   unsigned long t = PJPG_STATS_CLOCK()
+  #define PJPG_STATS_LAP(m, t)  do { unsigned long now_ = PJPG_STATS_CLOCK(); pCtx->mStats.m += now_ - (t); (t) = now_; } while (0)
+  #define PJPG_STATS_INC(m)     pCtx->mStats.m++
+#else
+  #define PJPG_STATS_START(t)   do { } while (0)
+  #define PJPG_STATS_LAP(m, t)  do { } while (0)
+  #define PJPG_STATS_INC(m)     do { } while (0)
+#endif
+//------------------------------------------------------------------------------
 #if PJPG_RIGHT_SHIFT_IS_ALWAYS_UNSIGNED
 static int16 replicateSignBit16(int8 n)
 {
@@ -64,6 +90,16 @@ static PJPG_INLINE long arithmeticRightShift8L(long x)
 #define PJPG_ARITH_SHIFT_RIGHT_8_L(x) ((x) >> 8)
 #endif
 //------------------------------------------------------------------------------
+#if PJPG_SIMD
+  #if defined (__ARM_NEON) || defined (__ARM_NEON__)
+    #include <arm_neon.h>
+    #define PJPG_NEON 1
+  #else
+    #include <emmintrin.h>
+    #define PJPG_NEON 0
+  #endif
+#endif
+//------------------------------------------------------------------------------
 // Change as needed - the PJPG_MAX_WIDTH/PJPG_MAX_HEIGHT checks are only present
 // to quickly detect bogus files.
 #define PJPG_MAX_WIDTH 16384
@@ -138,213 +174,252 @@ static const int8 ZAG[] =
    53, 60, 61, 54, 47, 55, 62, 63,
 };
 //------------------------------------------------------------------------------
-// 128 bytes
-static int16 gCoeffBuf[8*8];
-
-// 8*8*4 bytes * 3 = 768
-static uint8 gMCUBufR[256];
-static uint8 gMCUBufG[256];
-static uint8 gMCUBufB[256];
-
-// 256 bytes
-static int16 gQuant0[8*8];
-static int16 gQuant1[8*8];
-
-// 6 bytes
-static int16 gLastDC[3];
-
-typedef struct HuffTableT
-{
-   uint16 mMinCode[16];
-   uint16 mMaxCode[16];
-   uint8 mValPtr[16];
-} HuffTable;
-
-// DC - 192
-static HuffTable gHuffTab0;
-
-static uint8 gHuffVal0[16];
-
-static HuffTable gHuffTab1;
-static uint8 gHuffVal1[16];
-
-// AC - 672
-static HuffTable gHuffTab2;
-static uint8 gHuffVal2[256];
-
-static HuffTable gHuffTab3;
-static uint8 gHuffVal3[256];
-
-static uint8 gValidHuffTables;
-static uint8 gValidQuantTables;
-
-static uint8 gTemFlag;
-#define PJPG_MAX_IN_BUF_SIZE 256
-static uint8 gInBuf[PJPG_MAX_IN_BUF_SIZE];
-static uint8 gInBufOfs;
-static uint8 gInBufLeft;
+typedef pjpeg_huff_table_t HuffTable;
+#if PJPG_FAST_AC
+typedef pjpeg_fast_ac_table_t FastACTable;
+#endif
 
-static uint16 gBitBuf;
-static uint8 gBitsLeft;
+// Context used by the non reentrant pjpeg_decode_init()/pjpeg_decode_mcu().
+static pjpeg_context_t gContext;
 //------------------------------------------------------------------------------
-static uint16 gImageXSize;
-static uint16 gImageYSize;
-static uint8 gCompsInFrame;
-static uint8 gCompIdent[3];
-static uint8 gCompHSamp[3];
-static uint8 gCompVSamp[3];
-static uint8 gCompQuant[3];
-
-static uint16 gRestartInterval;
-static uint16 gNextRestartNum;
-static uint16 gRestartsLeft;
-
-static uint8 gCompsInScan;
-static uint8 gCompList[3];
-static uint8 gCompDCTab[3]; // 0,1
-static uint8 gCompACTab[3]; // 0,1
-
-static pjpeg_scan_type_t gScanType;
+static void fillInBuf(pjpeg_context_t *pCtx)
+{
+   unsigned char status;
+   PJPG_STATS_START(t);
 
-static uint8 gMaxBlocksPerMCU;
-static uint8 gMaxMCUXSize;
-static uint8 gMaxMCUYSize;
-static uint16 gMaxMCUSPerRow;
-static uint16 gMaxMCUSPerCol;
+   if (!pCtx->m_pNeedBytesCallback)
+   {
+      if (!pCtx->mInDataLeft)
+      {
+         // Out of data, getChar() pads with EOI markers from here on. Those can't be
+         // put back into the source, so the window moves to mInBuf's stuffing space
+         // as for the callback, and mpInData is cleared to have stuffChar() store them.
+         pCtx->mpInData = (const uint8*)0;
+         pCtx->mpInBuf = pCtx->mInBuf + 4;
+         pCtx->mInBufLeft = 0;
+         return;
+      }
 
-static uint16 gNumMCUSRemainingX, gNumMCUSRemainingY;
+      // Memory source, just move the window along. Until the data runs out, stuffed
+      // chars are real ones just read, so they are still in place in front of the
+      // window. The window is kept small enough for mInBufLeft to count them too.
+      pCtx->mpInBuf = pCtx->mpInData;
+      pCtx->mInBufLeft = (pjpeg_size_t)((pCtx->mInDataLeft > PJPG_IN_BUF_READ_SIZE) ? PJPG_IN_BUF_READ_SIZE : pCtx->mInDataLeft);
+      pCtx->mpInData += pCtx->mInBufLeft;
+      pCtx->mInDataLeft -= pCtx->mInBufLeft;
+#if PJPG_STATS
+      pCtx->mStats.m_bytesRead += pCtx->mInBufLeft;
+#endif
+      return;
+   }
 
-static uint8 gMCUOrg[6];
+   // Reserve a few bytes at the beginning of the buffer for putting back ("stuffing") chars.
+   pCtx->mpInBuf = pCtx->mInBuf + 4;
+   pCtx->mInBufLeft = 0;
 
-static pjpeg_need_bytes_callback_t g_pNeedBytesCallback;
-static void *g_pCallback_data;
-static uint8 gCallbackStatus;
-static uint8 gReduce;
-//------------------------------------------------------------------------------
-static void fillInBuf(void)
-{
-   unsigned char status;
+   status = (*pCtx->m_pNeedBytesCallback)(pCtx->mInBuf + 4, PJPG_IN_BUF_READ_SIZE, &pCtx->mInBufLeft, pCtx->m_pCallback_data);
 
-   // Reserve a few bytes at the beginning of the buffer for putting back ("stuffing") chars.
-   gInBufOfs = 4;
-   gInBufLeft = 0;
+   PJPG_STATS_LAP(m_inputTicks, t);
+   PJPG_STATS_INC(m_inputCalls);
+#if PJPG_STATS
+   pCtx->mStats.m_bytesRead += pCtx->mInBufLeft;
+#endif
 
-   status = (*g_pNeedBytesCallback)(gInBuf + gInBufOfs, PJPG_MAX_IN_BUF_SIZE - gInBufOfs, &gInBufLeft, g_pCallback_data);
    if (status)
    {
       // The user provided need bytes callback has indicated an error, so record the error and continue trying to decode.
       // The highest level pjpeg entrypoints will catch the error and return the non-zero status.
-      gCallbackStatus = status;
+      pCtx->mCallbackStatus = status;
    }
 }   
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint8 getChar(void)
+static PJPG_INLINE uint8 getChar(pjpeg_context_t *pCtx)
 {
-   if (!gInBufLeft)
+   if (!pCtx->mInBufLeft)
    {
-      fillInBuf();
-      if (!gInBufLeft)
+      fillInBuf(pCtx);
+      if (!pCtx->mInBufLeft)
       {
-         gTemFlag = ~gTemFlag;
-         return gTemFlag ? 0xFF : 0xD9;
+         pCtx->mTemFlag = ~pCtx->mTemFlag;
+         return pCtx->mTemFlag ? 0xFF : 0xD9;
       } 
    }
    
-   gInBufLeft--;
-   return gInBuf[gInBufOfs++];
+   pCtx->mInBufLeft--;
+   return *pCtx->mpInBuf++;
 }
 //------------------------------------------------------------------------------
-static PJPG_INLINE void stuffChar(uint8 i)
+static PJPG_INLINE void stuffChar(pjpeg_context_t *pCtx, uint8 i)
 {
-   gInBufOfs--;
-   gInBuf[gInBufOfs] = i;
-   gInBufLeft++;
+   pCtx->mpInBuf--;
+   // The window is in mInBuf unless it is over the memory source, see fillInBuf()
+   if (!pCtx->mpInData)
+      pCtx->mInBuf[pCtx->mpInBuf - pCtx->mInBuf] = i;
+   pCtx->mInBufLeft++;
 }
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint8 getOctet(uint8 FFCheck)
+static PJPG_INLINE uint8 getOctet(pjpeg_context_t *pCtx, uint8 FFCheck)
 {
-   uint8 c = getChar();
+   uint8 c = getChar(pCtx);
       
    if ((FFCheck) && (c == 0xFF))
    {
-      uint8 n = getChar();
+      uint8 n = getChar(pCtx);
 
       if (n)
       {
-         stuffChar(n);
-         stuffChar(0xFF);
+         stuffChar(pCtx, n);
+         stuffChar(pCtx, 0xFF);
       }
    }
 
    return c;
 }
 //------------------------------------------------------------------------------
-static uint16 getBits(uint8 numBits, uint8 FFCheck)
+static uint16 getBits(pjpeg_context_t *pCtx, uint8 numBits, uint8 FFCheck)
 {
    uint8 origBits = numBits;
-   uint16 ret = gBitBuf;
+   uint16 ret = pCtx->mBitBuf;
    
    if (numBits > 8)
    {
       numBits -= 8;
       
-      gBitBuf <<= gBitsLeft;
+      pCtx->mBitBuf <<= pCtx->mBitsLeft;
       
-      gBitBuf |= getOctet(FFCheck);
+      pCtx->mBitBuf |= getOctet(pCtx, FFCheck);
       
-      gBitBuf <<= (8 - gBitsLeft);
+      pCtx->mBitBuf <<= (8 - pCtx->mBitsLeft);
       
-      ret = (ret & 0xFF00) | (gBitBuf >> 8);
+      ret = (ret & 0xFF00) | (pCtx->mBitBuf >> 8);
    }
       
-   if (gBitsLeft < numBits)
+   if (pCtx->mBitsLeft < numBits)
    {
-      gBitBuf <<= gBitsLeft;
+      pCtx->mBitBuf <<= pCtx->mBitsLeft;
       
-      gBitBuf |= getOctet(FFCheck);
+      pCtx->mBitBuf |= getOctet(pCtx, FFCheck);
       
-      gBitBuf <<= (numBits - gBitsLeft);
+      pCtx->mBitBuf <<= (numBits - pCtx->mBitsLeft);
                         
-      gBitsLeft = 8 - (numBits - gBitsLeft);
+      pCtx->mBitsLeft = 8 - (numBits - pCtx->mBitsLeft);
    }
    else
    {
-      gBitsLeft = (uint8)(gBitsLeft - numBits);
-      gBitBuf <<= numBits;
+      pCtx->mBitsLeft = (uint8)(pCtx->mBitsLeft - numBits);
+      pCtx->mBitBuf <<= numBits;
    }
    
    return ret >> (16 - origBits);
 }
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint16 getBits1(uint8 numBits)
+static PJPG_INLINE uint16 getBits1(pjpeg_context_t *pCtx, uint8 numBits)
+{
+   return getBits(pCtx, numBits, 0);
+}
+//------------------------------------------------------------------------------
+#if PJPG_BITBUF_BITS > 16
+// Tops up the reservoir a byte at a time until it can't take another whole byte.
+// Bytes are copied straight out of the input buffer until an 0xFF is seen, only
+// then does getOctet() deal with the stuffed zero or marker.
+static void fillEntropyBits(pjpeg_context_t *pCtx)
+{
+   while (pCtx->mEntropyBitsLeft <= (PJPG_BITBUF_BITS - 8))
+   {
+      uint8 c;
+
+      if ((pCtx->mInBufLeft) && (*pCtx->mpInBuf != 0xFF))
+      {
+         c = *pCtx->mpInBuf++;
+         pCtx->mInBufLeft--;
+      }
+      else
+         c = getOctet(pCtx, 1);
+
+      pCtx->mEntropyBitBuf |= (pjpeg_bitbuf_t)c << (PJPG_BITBUF_BITS - 8 - pCtx->mEntropyBitsLeft);
+      pCtx->mEntropyBitsLeft = (uint8)(pCtx->mEntropyBitsLeft + 8);
+   }
+}
+//------------------------------------------------------------------------------
+static PJPG_INLINE uint16 getBits2(pjpeg_context_t *pCtx, uint8 numBits)
+{
+   uint16 ret;
+
+   if (pCtx->mEntropyBitsLeft < numBits)
+      fillEntropyBits(pCtx);
+
+   ret = (uint16)(pCtx->mEntropyBitBuf >> (PJPG_BITBUF_BITS - numBits));
+
+   pCtx->mEntropyBitBuf <<= numBits;
+   pCtx->mEntropyBitsLeft = (uint8)(pCtx->mEntropyBitsLeft - numBits);
+
+   return ret;
+}
+//------------------------------------------------------------------------------
+static PJPG_INLINE uint8 getBit(pjpeg_context_t *pCtx)
+{
+   return (uint8)getBits2(pCtx, 1);
+}
+//------------------------------------------------------------------------------
+#if PJPG_FAST_HUFFMAN
+// Returns the next 8 bits of entropy coded data without consuming them.
+static PJPG_INLINE uint8 peekBits8(pjpeg_context_t *pCtx)
 {
-   return getBits(numBits, 0);
+   if (pCtx->mEntropyBitsLeft < 8)
+      fillEntropyBits(pCtx);
+
+   return (uint8)(pCtx->mEntropyBitBuf >> (PJPG_BITBUF_BITS - 8));
 }
+#endif
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint16 getBits2(uint8 numBits)
+// Starts reading entropy coded data at the current input position.
+static void initEntropyBits(pjpeg_context_t *pCtx)
+{
+   pCtx->mEntropyBitBuf = 0;
+   pCtx->mEntropyBitsLeft = 0;
+}
+#else
+static PJPG_INLINE uint16 getBits2(pjpeg_context_t *pCtx, uint8 numBits)
 {
-   return getBits(numBits, 1);
+   return getBits(pCtx, numBits, 1);
 }
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint8 getBit(void)
+static PJPG_INLINE uint8 getBit(pjpeg_context_t *pCtx)
 {
    uint8 ret = 0;
-   if (gBitBuf & 0x8000) 
+   if (pCtx->mBitBuf & 0x8000) 
       ret = 1;
    
-   if (!gBitsLeft)
+   if (!pCtx->mBitsLeft)
    {
-      gBitBuf |= getOctet(1);
+      pCtx->mBitBuf |= getOctet(pCtx, 1);
 
-      gBitsLeft += 8;
+      pCtx->mBitsLeft += 8;
    }
    
-   gBitsLeft--;
-   gBitBuf <<= 1;
+   pCtx->mBitsLeft--;
+   pCtx->mBitBuf <<= 1;
    
    return ret;
 }
 //------------------------------------------------------------------------------
+#if PJPG_FAST_HUFFMAN
+// Returns the next 8 bits of entropy coded data without consuming them.
+static PJPG_INLINE uint8 peekBits8(pjpeg_context_t *pCtx)
+{
+   return (uint8)(pCtx->mBitBuf >> 8);
+}
+#endif
+//------------------------------------------------------------------------------
+// Starts reading entropy coded data at the current input position.
+static void initEntropyBits(pjpeg_context_t *pCtx)
+{
+   pCtx->mBitsLeft = 8;
+   getBits2(pCtx, 8);
+   getBits2(pCtx, 8);
+}
+#endif
+//------------------------------------------------------------------------------
 static uint16 getExtendTest(uint8 i)
 {
    switch (i)
@@ -398,11 +473,30 @@ static PJPG_INLINE int16 huffExtend(uint16 x, uint8 s)
    return ((x < getExtendTest(s)) ? ((int16)x + getExtendOffset(s)) : (int16)x);
 }
 //------------------------------------------------------------------------------
-static PJPG_INLINE uint8 huffDecode(const HuffTable* pHuffTable, const uint8* pHuffVal)
+static PJPG_INLINE uint8 huffDecode(pjpeg_context_t *pCtx, const HuffTable* pHuffTable, const uint8* pHuffVal)
 {
-   uint8 i = 0;
+   uint8 i;
    uint8 j;
-   uint16 code = getBit();
+   uint16 code;
+
+#if PJPG_FAST_HUFFMAN
+   // Short codes are resolved with one lookup.
+   uint8 look = peekBits8(pCtx);
+   uint8 len = pHuffTable->mLookLen[look];
+
+   if (len)
+   {
+      getBits2(pCtx, len);
+      return pHuffTable->mLookVal[look];
+   }
+
+   // Long code, carry on a bit at a time after the lookahead bits.
+   code = getBits2(pCtx, PJPG_HUFF_LOOKAHEAD_BITS);
+   i = PJPG_HUFF_LOOKAHEAD_BITS - 1;
+#else
+   i = 0;
+   code = getBit(pCtx);
+#endif
 
    // This func only reads a bit at a time, which on modern CPU's is not terribly efficient.
    // But on microcontrollers without strong integer shifting support this seems like a 
@@ -420,7 +514,7 @@ static PJPG_INLINE uint8 huffDecode(const HuffTable* pHuffTable, const uint8* pH
 
       i++;
       code <<= 1;
-      code |= getBit();
+      code |= getBit(pCtx);
    }
 
    j = pHuffTable->mValPtr[i];
@@ -429,12 +523,19 @@ static PJPG_INLINE uint8 huffDecode(const HuffTable* pHuffTable, const uint8* pH
    return pHuffVal[j];
 }
 //------------------------------------------------------------------------------
-static void huffCreate(const uint8* pBits, HuffTable* pHuffTable)
+static void huffCreate(const uint8* pBits, HuffTable* pHuffTable, const uint8* pHuffVal)
 {
    uint8 i = 0;
    uint8 j = 0;
 
    uint16 code = 0;
+
+#if PJPG_FAST_HUFFMAN
+   uint16 k;
+
+   for (k = 0; k < PJPG_HUFF_LOOKAHEAD_SIZE; k++)
+      pHuffTable->mLookLen[k] = 0;
+#endif
       
    for ( ; ; )
    {
@@ -451,6 +552,33 @@ static void huffCreate(const uint8* pBits, HuffTable* pHuffTable)
          pHuffTable->mMinCode[i] = code;
          pHuffTable->mMaxCode[i] = code + num - 1;
          pHuffTable->mValPtr[i] = j;
+
+#if PJPG_FAST_HUFFMAN
+         if (i < PJPG_HUFF_LOOKAHEAD_BITS)
+         {
+            // Every lookahead value that starts with this code decodes to it.
+            uint8 shift = (uint8)(PJPG_HUFF_LOOKAHEAD_BITS - 1 - i);
+            uint8 n;
+
+            for (n = 0; n < num; n++)
+            {
+               uint16 first = (uint16)((code + n) << shift);
+               uint16 last = (uint16)(first + (1U << shift));
+
+               // Codes that overflow the length are bad tables, don't index past the end.
+               if (last > PJPG_HUFF_LOOKAHEAD_SIZE)
+                  break;
+
+               for (k = first; k < last; k++)
+               {
+                  pHuffTable->mLookLen[k] = (uint8)(i + 1);
+                  pHuffTable->mLookVal[k] = pHuffVal[(uint8)(j + n)];
+               }
+            }
+         }
+#else
+         (void)pHuffVal;
+#endif
          
          j = (uint8)(j + num);
          
@@ -465,30 +593,58 @@ static void huffCreate(const uint8* pBits, HuffTable* pHuffTable)
    }
 }
 //------------------------------------------------------------------------------
-static HuffTable* getHuffTable(uint8 index)
+#if PJPG_FAST_AC
+static void fastACCreate(const HuffTable* pHuffTable, FastACTable* pFastAC)
+{
+   uint16 i;
+
+   for (i = 0; i < PJPG_HUFF_LOOKAHEAD_SIZE; i++)
+   {
+      uint8 len = pHuffTable->mLookLen[i];
+      uint8 rs = pHuffTable->mLookVal[i];
+      uint8 s = rs & 15;
+
+      pFastAC->mRunLen[i] = 0;
+      pFastAC->mVal[i] = 0;
+
+      // EOB and ZRL (s == 0) are left to the normal path.
+      if ((len) && (s) && ((len + s) <= PJPG_HUFF_LOOKAHEAD_BITS))
+      {
+         // The magnitude bits follow the code within the lookahead bits.
+         uint16 x = (uint16)(((i << len) & (PJPG_HUFF_LOOKAHEAD_SIZE - 1)) >> (PJPG_HUFF_LOOKAHEAD_BITS - s));
+         int16 v = huffExtend(x, s);
+
+         pFastAC->mRunLen[i] = (uint8)((rs & 0xF0) | (len + s));
+         pFastAC->mVal[i] = (int8)v;
+      }
+   }
+}
+#endif
+//------------------------------------------------------------------------------
+static HuffTable* getHuffTable(pjpeg_context_t *pCtx, uint8 index)
 {
    // 0-1 = DC
    // 2-3 = AC
    switch (index)
    {
-      case 0: return &gHuffTab0;
-      case 1: return &gHuffTab1;
-      case 2: return &gHuffTab2;
-      case 3: return &gHuffTab3;
+      case 0: return &pCtx->mHuffTab0;
+      case 1: return &pCtx->mHuffTab1;
+      case 2: return &pCtx->mHuffTab2;
+      case 3: return &pCtx->mHuffTab3;
       default: return 0;
    }
 }
 //------------------------------------------------------------------------------
-static uint8* getHuffVal(uint8 index)
+static uint8* getHuffVal(pjpeg_context_t *pCtx, uint8 index)
 {
    // 0-1 = DC
    // 2-3 = AC
    switch (index)
    {
-      case 0: return gHuffVal0;
-      case 1: return gHuffVal1;
-      case 2: return gHuffVal2;
-      case 3: return gHuffVal3;
+      case 0: return pCtx->mHuffVal0;
+      case 1: return pCtx->mHuffVal1;
+      case 2: return pCtx->mHuffVal2;
+      case 3: return pCtx->mHuffVal3;
       default: return 0;
    }
 }
@@ -498,10 +654,20 @@ static uint16 getMaxHuffCodes(uint8 index)
    return (index < 2) ? 12 : 255;
 }
 //------------------------------------------------------------------------------
-static uint8 readDHTMarker(void)
+#if PJPG_TABLE_CACHE
+// FNV-1a, of the bytes each table is built from
+#define PJPG_TABLE_HASH_INIT 2166136261UL
+
+static PJPG_INLINE unsigned long hashByte(unsigned long hash, uint8 c)
+{
+   return (hash ^ c) * 16777619UL;
+}
+#endif
+//------------------------------------------------------------------------------
+static uint8 readDHTMarker(pjpeg_context_t *pCtx)
 {
    uint8 bits[16];
-   uint16 left = getBits1(16);
+   uint16 left = getBits1(pCtx, 16);
 
    if (left < 2)
       return PJPG_BAD_DHT_MARKER;
@@ -514,32 +680,51 @@ static uint8 readDHTMarker(void)
       uint8* pHuffVal;
       HuffTable* pHuffTable;
       uint16 count, totalRead;
+#if PJPG_TABLE_CACHE
+      uint8 kept;
+      unsigned long hash = PJPG_TABLE_HASH_INIT;
+#endif
             
-      index = (uint8)getBits1(8);
+      index = (uint8)getBits1(pCtx, 8);
       
       if ( ((index & 0xF) > 1) || ((index & 0xF0) > 0x10) )
          return PJPG_BAD_DHT_INDEX;
       
       tableIndex = ((index >> 3) & 2) + (index & 1);
       
-      pHuffTable = getHuffTable(tableIndex);
-      pHuffVal = getHuffVal(tableIndex);
+      pHuffTable = getHuffTable(pCtx, tableIndex);
+      pHuffVal = getHuffVal(pCtx, tableIndex);
+
+#if PJPG_TABLE_CACHE
+      kept = pCtx->mValidHuffTables & (1 << tableIndex);
+#endif
       
-      gValidHuffTables |= (1 << tableIndex);
+      // Not valid again until it has been rebuilt, it may be kept for the next image
+      pCtx->mValidHuffTables &= ~(1 << tableIndex);
             
       count = 0;
       for (i = 0; i <= 15; i++)
       {
-         uint8 n = (uint8)getBits1(8);
+         uint8 n = (uint8)getBits1(pCtx, 8);
          bits[i] = n;
          count = (uint16)(count + n);
+#if PJPG_TABLE_CACHE
+         hash = hashByte(hash, n);
+#endif
       }
       
       if (count > getMaxHuffCodes(tableIndex))
          return PJPG_BAD_DHT_COUNTS;
 
+      // Read into mMCUBufR (unused while markers are read, and big enough for 255 values)
+      // so a kept table is still intact if they turn out to be the same
       for (i = 0; i < count; i++)
-         pHuffVal[i] = (uint8)getBits1(8);
+      {
+         pCtx->mMCUBufR[i] = (uint8)getBits1(pCtx, 8);
+#if PJPG_TABLE_CACHE
+         hash = hashByte(hash, pCtx->mMCUBufR[i]);
+#endif
+      }
 
       totalRead = 1 + 16 + count;
 
@@ -548,17 +733,131 @@ static uint8 readDHTMarker(void)
 
       left = (uint16)(left - totalRead);
 
-      huffCreate(bits, pHuffTable);
+#if PJPG_TABLE_CACHE
+      if ((kept) && (pCtx->mHuffHash[tableIndex] == hash))
+      {
+         pCtx->mValidHuffTables |= (1 << tableIndex);
+         PJPG_STATS_INC(m_tablesKept);
+         continue;
+      }
+
+      pCtx->mHuffHash[tableIndex] = hash;
+#endif
+
+      for (i = 0; i < count; i++)
+         pHuffVal[i] = pCtx->mMCUBufR[i];
+
+      huffCreate(bits, pHuffTable, pHuffVal);
+
+#if PJPG_FAST_AC
+      if (tableIndex > 1)
+         fastACCreate(pHuffTable, (tableIndex == 3) ? &pCtx->mFastAC3 : &pCtx->mFastAC2);
+#endif
+
+      pCtx->mValidHuffTables |= (1 << tableIndex);
    }
       
    return 0;
 }
 //------------------------------------------------------------------------------
+#if PJPG_DEFAULT_HUFF_TABLES
+// The typical Huffman tables from Annex K.3 of the JPEG spec, luminance tables
+// are used for table 0 and chrominance for table 1.
+static const uint8 gStdDCBits[2][16] =
+{
+   { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 },
+   { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 }
+};
+
+static const uint8 gStdDCVal[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8 gStdACBits[2][16] =
+{
+   { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d },
+   { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 }
+};
+
+static const uint8 gStdACVal[2][162] =
+{
+   {
+      0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+      0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+      0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+      0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+      0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+      0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+      0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+      0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+      0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+      0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+      0xf9, 0xfa
+   },
+   {
+      0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+      0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+      0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+      0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+      0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+      0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+      0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+      0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+      0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+      0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+      0xf9, 0xfa
+   }
+};
+
+// Builds Huffman table tableIndex (numbered as in readDHTMarker()) from the standard tables
+static void loadStdHuffTable(pjpeg_context_t *pCtx, uint8 tableIndex)
+{
+   uint8 i, id = tableIndex & 1;
+   uint8* pHuffVal = getHuffVal(pCtx, tableIndex);
+   const uint8* pBits;
+   uint16 count = 0;
+
+   if (tableIndex < 2)
+   {
+      pBits = gStdDCBits[id];
+      for (i = 0; i < sizeof(gStdDCVal); i++)
+         pHuffVal[i] = gStdDCVal[i];
+   }
+   else
+   {
+      pBits = gStdACBits[id];
+      for (i = 0; i < sizeof(gStdACVal[id]); i++)
+         pHuffVal[i] = gStdACVal[id][i];
+   }
+
+   huffCreate(pBits, getHuffTable(pCtx, tableIndex), pHuffVal);
+
+#if PJPG_FAST_AC
+   if (tableIndex > 1)
+      fastACCreate(getHuffTable(pCtx, tableIndex), (tableIndex == 3) ? &pCtx->mFastAC3 : &pCtx->mFastAC2);
+#endif
+
+#if PJPG_TABLE_CACHE
+   // Hashed as readDHTMarker() would, a DHT segment holding the standard table matches it
+   pCtx->mHuffHash[tableIndex] = PJPG_TABLE_HASH_INIT;
+   for (i = 0; i < 16; i++)
+   {
+      pCtx->mHuffHash[tableIndex] = hashByte(pCtx->mHuffHash[tableIndex], pBits[i]);
+      count = (uint16)(count + pBits[i]);
+   }
+   for (i = 0; i < count; i++)
+      pCtx->mHuffHash[tableIndex] = hashByte(pCtx->mHuffHash[tableIndex], pHuffVal[i]);
+#else
+   (void)count;
+#endif
+
+   pCtx->mValidHuffTables |= (1 << tableIndex);
+}
+#endif
+//------------------------------------------------------------------------------
 static void createWinogradQuant(int16* pQuant);
 
-static uint8 readDQTMarker(void)
+static uint8 readDQTMarker(pjpeg_context_t *pCtx)
 {
-   uint16 left = getBits1(16);
+   uint16 left = getBits1(pCtx, 16);
 
    if (left < 2)
       return PJPG_BAD_DQT_MARKER;
@@ -568,32 +867,57 @@ static uint8 readDQTMarker(void)
    while (left)
    {
       uint8 i;
-      uint8 n = (uint8)getBits1(8);
+      uint8 n = (uint8)getBits1(pCtx, 8);
       uint8 prec = n >> 4;
       uint16 totalRead;
+      int16* pQuant;
+#if PJPG_TABLE_CACHE
+      uint8 kept;
+      unsigned long hash = hashByte(PJPG_TABLE_HASH_INIT, prec);
+#endif
 
       n &= 0x0F;
 
       if (n > 1)
          return PJPG_BAD_DQT_TABLE;
 
-      gValidQuantTables |= (n ? 2 : 1);         
+      pQuant = n ? pCtx->mQuant1 : pCtx->mQuant0;
+
+#if PJPG_TABLE_CACHE
+      kept = pCtx->mValidQuantTables & (n ? 2 : 1);
+#endif
+
+      pCtx->mValidQuantTables |= (n ? 2 : 1);         
 
-      // read quantization entries, in zag order
+      // read quantization entries, in zag order, into mCoeffBuf (unused while markers
+      // are read) so a kept table is still intact if they turn out to be the same
       for (i = 0; i < 64; i++)
       {
-         uint16 temp = getBits1(8);
+         uint16 temp = getBits1(pCtx, 8);
 
          if (prec)
-            temp = (temp << 8) + getBits1(8);
+            temp = (temp << 8) + getBits1(pCtx, 8);
 
-         if (n)
-            gQuant1[i] = (int16)temp;            
-         else
-            gQuant0[i] = (int16)temp;            
+         pCtx->mCoeffBuf[i] = (int16)temp;
+#if PJPG_TABLE_CACHE
+         hash = hashByte(hashByte(hash, (uint8)(temp >> 8)), (uint8)temp);
+#endif
+      }
+
+#if PJPG_TABLE_CACHE
+      if ((kept) && (pCtx->mQuantHash[n] == hash))
+         PJPG_STATS_INC(m_tablesKept);
+      else
+#endif
+      {
+#if PJPG_TABLE_CACHE
+         pCtx->mQuantHash[n] = hash;
+#endif
+         for (i = 0; i < 64; i++)
+            pQuant[i] = pCtx->mCoeffBuf[i];
+
+         createWinogradQuant(pQuant);
       }
-      
-      createWinogradQuant(n ? gQuant1 : gQuant0);
 
       totalRead = 64 + 1;
 
@@ -609,127 +933,178 @@ static uint8 readDQTMarker(void)
    return 0;
 }
 //------------------------------------------------------------------------------
-static uint8 readSOFMarker(void)
+static uint8 readSOFMarker(pjpeg_context_t *pCtx)
 {
    uint8 i;
-   uint16 left = getBits1(16);
+   uint16 left = getBits1(pCtx, 16);
 
-   if (getBits1(8) != 8)   
+   if (getBits1(pCtx, 8) != 8)   
       return PJPG_BAD_PRECISION;
 
-   gImageYSize = getBits1(16);
+   pCtx->mImageYSize = getBits1(pCtx, 16);
 
-   if ((!gImageYSize) || (gImageYSize > PJPG_MAX_HEIGHT))
+   if ((!pCtx->mImageYSize) || (pCtx->mImageYSize > PJPG_MAX_HEIGHT))
       return PJPG_BAD_HEIGHT;
 
-   gImageXSize = getBits1(16);
+   pCtx->mImageXSize = getBits1(pCtx, 16);
 
-   if ((!gImageXSize) || (gImageXSize > PJPG_MAX_WIDTH))
+   if ((!pCtx->mImageXSize) || (pCtx->mImageXSize > PJPG_MAX_WIDTH))
       return PJPG_BAD_WIDTH;
 
-   gCompsInFrame = (uint8)getBits1(8);
+   pCtx->mCompsInFrame = (uint8)getBits1(pCtx, 8);
 
-   if (gCompsInFrame > 3)
+   if (pCtx->mCompsInFrame > 3)
       return PJPG_TOO_MANY_COMPONENTS;
 
-   if (left != (gCompsInFrame + gCompsInFrame + gCompsInFrame + 8))
+   if (left != (pCtx->mCompsInFrame + pCtx->mCompsInFrame + pCtx->mCompsInFrame + 8))
       return PJPG_BAD_SOF_LENGTH;
    
-   for (i = 0; i < gCompsInFrame; i++)
+   for (i = 0; i < pCtx->mCompsInFrame; i++)
    {
-      gCompIdent[i] = (uint8)getBits1(8);
-      gCompHSamp[i] = (uint8)getBits1(4);
-      gCompVSamp[i] = (uint8)getBits1(4);
-      gCompQuant[i] = (uint8)getBits1(8);
+      pCtx->mCompIdent[i] = (uint8)getBits1(pCtx, 8);
+      pCtx->mCompHSamp[i] = (uint8)getBits1(pCtx, 4);
+      pCtx->mCompVSamp[i] = (uint8)getBits1(pCtx, 4);
+      pCtx->mCompQuant[i] = (uint8)getBits1(pCtx, 8);
       
-      if (gCompQuant[i] > 1)
+      if (pCtx->mCompQuant[i] > 1)
          return PJPG_UNSUPPORTED_QUANT_TABLE;
    }
    
    return 0;
 }
 //------------------------------------------------------------------------------
+// Passes over the next n bytes of input (after those already in the bit buffer),
+// seeking the source if it can.
+static void skipBytes(pjpeg_context_t *pCtx, unsigned long n)
+{
+   pjpeg_size_t t = (pjpeg_size_t)((n < pCtx->mInBufLeft) ? n : pCtx->mInBufLeft);
+
+   pCtx->mpInBuf += t;
+   pCtx->mInBufLeft -= t;
+   n -= t;
+
+   if (!n)
+      return;
+
+   if (!pCtx->m_pNeedBytesCallback)
+   {
+      if (n > pCtx->mInDataLeft)
+         n = pCtx->mInDataLeft;
+      if (n)
+      {
+         pCtx->mpInData += n;
+         pCtx->mInDataLeft -= n;
+      }
+      return;
+   }
+
+   if ((pCtx->m_pSkipBytesCallback) && (!(*pCtx->m_pSkipBytesCallback)(n, pCtx->m_pCallback_data)))
+      return;
+
+   // The source can't seek, read the bytes a buffer at a time
+   while (n)
+   {
+      fillInBuf(pCtx);
+      if (!pCtx->mInBufLeft)
+         return;
+
+      t = (pjpeg_size_t)((n < pCtx->mInBufLeft) ? n : pCtx->mInBufLeft);
+      pCtx->mpInBuf += t;
+      pCtx->mInBufLeft -= t;
+      n -= t;
+   }
+}
+//------------------------------------------------------------------------------
 // Used to skip unrecognized markers.
-static uint8 skipVariableMarker(void)
+static uint8 skipVariableMarker(pjpeg_context_t *pCtx)
 {
-   uint16 left = getBits1(16);
+   uint16 left = getBits1(pCtx, 16);
 
    if (left < 2)
       return PJPG_BAD_VARIABLE_MARKER;
 
    left -= 2;
 
-   while (left)
-   {
-      getBits1(8);
-      left--;
-   }
+   // The segment's first byte is already in the bit buffer, the rest are skipped in
+   // the input and then the first is shifted out to bring in the following byte
+   if (left > 1)
+      skipBytes(pCtx, left - 1);
+
+   if (left)
+      getBits1(pCtx, 8);
    
    return 0;
 }
 //------------------------------------------------------------------------------
 // Read a define restart interval (DRI) marker.
-static uint8 readDRIMarker(void)
+static uint8 readDRIMarker(pjpeg_context_t *pCtx)
 {
-   if (getBits1(16) != 4)
+   if (getBits1(pCtx, 16) != 4)
       return PJPG_BAD_DRI_LENGTH;
 
-   gRestartInterval = getBits1(16);
+   pCtx->mRestartInterval = getBits1(pCtx, 16);
    
    return 0;
 }
 //------------------------------------------------------------------------------
 // Read a start of scan (SOS) marker.
-static uint8 readSOSMarker(void)
+static uint8 readSOSMarker(pjpeg_context_t *pCtx)
 {
    uint8 i;
-   uint16 left = getBits1(16);
+   uint16 left = getBits1(pCtx, 16);
    uint8 spectral_start, spectral_end, successive_high, successive_low;
 
-   gCompsInScan = (uint8)getBits1(8);
+   pCtx->mCompsInScan = (uint8)getBits1(pCtx, 8);
 
    left -= 3;
 
-   if ( (left != (gCompsInScan + gCompsInScan + 3)) || (gCompsInScan < 1) || (gCompsInScan > PJPG_MAXCOMPSINSCAN) )
+   if ( (left != (pCtx->mCompsInScan + pCtx->mCompsInScan + 3)) || (pCtx->mCompsInScan < 1) || (pCtx->mCompsInScan > PJPG_MAXCOMPSINSCAN) )
       return PJPG_BAD_SOS_LENGTH;
    
-   for (i = 0; i < gCompsInScan; i++)
+   for (i = 0; i < pCtx->mCompsInScan; i++)
    {
-      uint8 cc = (uint8)getBits1(8);
-      uint8 c = (uint8)getBits1(8);
+      uint8 cc = (uint8)getBits1(pCtx, 8);
+      uint8 c = (uint8)getBits1(pCtx, 8);
       uint8 ci;
       
       left -= 2;
      
-      for (ci = 0; ci < gCompsInFrame; ci++)
-         if (cc == gCompIdent[ci])
+      for (ci = 0; ci < pCtx->mCompsInFrame; ci++)
+         if (cc == pCtx->mCompIdent[ci])
             break;
 
-      if (ci >= gCompsInFrame)
+      if (ci >= pCtx->mCompsInFrame)
          return PJPG_BAD_SOS_COMP_ID;
 
-      gCompList[i]    = ci;
-      gCompDCTab[ci] = (c >> 4) & 15;
-      gCompACTab[ci] = (c & 15);
+      pCtx->mCompList[i]    = ci;
+      pCtx->mCompDCTab[ci] = (c >> 4) & 15;
+      pCtx->mCompACTab[ci] = (c & 15);
    }
 
-   spectral_start  = (uint8)getBits1(8);
-   spectral_end    = (uint8)getBits1(8);
-   successive_high = (uint8)getBits1(4);
-   successive_low  = (uint8)getBits1(4);
+   spectral_start  = (uint8)getBits1(pCtx, 8);
+   spectral_end    = (uint8)getBits1(pCtx, 8);
+   successive_high = (uint8)getBits1(pCtx, 4);
+   successive_low  = (uint8)getBits1(pCtx, 4);
+
+#if PJPG_PROGRESSIVE
+   pCtx->mSpectralStart = spectral_start;
+   pCtx->mSpectralEnd = spectral_end;
+   pCtx->mSuccessiveHigh = successive_high;
+   pCtx->mSuccessiveLow = successive_low;
+#endif
 
    left -= 3;
 
    while (left)                  
    {
-      getBits1(8);
+      getBits1(pCtx, 8);
       left--;
    }
    
    return 0;
 }
 //------------------------------------------------------------------------------
-static uint8 nextMarker(void)
+static uint8 nextMarker(pjpeg_context_t *pCtx)
 {
    uint8 c;
    uint8 bytes = 0;
@@ -740,13 +1115,13 @@ static uint8 nextMarker(void)
       {
          bytes++;
 
-         c = (uint8)getBits1(8);
+         c = (uint8)getBits1(pCtx, 8);
 
       } while (c != 0xFF);
 
       do
       {
-         c = (uint8)getBits1(8);
+         c = (uint8)getBits1(pCtx, 8);
 
       } while (c == 0xFF);
 
@@ -759,11 +1134,11 @@ static uint8 nextMarker(void)
 //------------------------------------------------------------------------------
 // Process markers. Returns when an SOFx, SOI, EOI, or SOS marker is
 // encountered.
-static uint8 processMarkers(uint8* pMarker)
+static uint8 processMarkers(pjpeg_context_t *pCtx, uint8* pMarker)
 {
    for ( ; ; )
    {
-      uint8 c = nextMarker();
+      uint8 c = nextMarker(pCtx);
 
       switch (c)
       {
@@ -790,7 +1165,7 @@ static uint8 processMarkers(uint8* pMarker)
          }
          case M_DHT:
          {
-            readDHTMarker();
+            readDHTMarker(pCtx);
             break;
          }
          // Sorry, no arithmetic support at this time. Dumb patents!
@@ -800,12 +1175,12 @@ static uint8 processMarkers(uint8* pMarker)
          }
          case M_DQT:
          {
-            readDQTMarker();
+            readDQTMarker(pCtx);
             break;
          }
          case M_DRI:
          {
-            readDRIMarker();
+            readDRIMarker(pCtx);
             break;
          }
          //case M_APP0:  /* no need to read the JFIF marker */
@@ -825,7 +1200,7 @@ static uint8 processMarkers(uint8* pMarker)
          }
          default:    /* must be DNL, DHP, EXP, APPn, JPGn, COM, or RESn or APP0 */
          {
-            skipVariableMarker();
+            skipVariableMarker(pCtx);
             break;
          }
       }
@@ -834,13 +1209,13 @@ static uint8 processMarkers(uint8* pMarker)
 }
 //------------------------------------------------------------------------------
 // Finds the start of image (SOI) marker.
-static uint8 locateSOIMarker(void)
+static uint8 locateSOIMarker(pjpeg_context_t *pCtx)
 {
    uint16 bytesleft;
    
-   uint8 lastchar = (uint8)getBits1(8);
+   uint8 lastchar = (uint8)getBits1(pCtx, 8);
 
-   uint8 thischar = (uint8)getBits1(8);
+   uint8 thischar = (uint8)getBits1(pCtx, 8);
 
    /* ok if it's a normal JPEG file without a special header */
 
@@ -856,7 +1231,7 @@ static uint8 locateSOIMarker(void)
 
       lastchar = thischar;
 
-      thischar = (uint8)getBits1(8);
+      thischar = (uint8)getBits1(pCtx, 8);
 
       if (lastchar == 0xFF) 
       {
@@ -870,7 +1245,7 @@ static uint8 locateSOIMarker(void)
    /* Check the next character after marker: if it's not 0xFF, it can't
    be the start of the next marker, so the file is bad */
 
-   thischar = (uint8)((gBitBuf >> 8) & 0xFF);
+   thischar = (uint8)((pCtx->mBitBuf >> 8) & 0xFF);
 
    if (thischar != 0xFF)
       return PJPG_NOT_JPEG;
@@ -879,15 +1254,15 @@ static uint8 locateSOIMarker(void)
 }
 //------------------------------------------------------------------------------
 // Find a start of frame (SOF) marker.
-static uint8 locateSOFMarker(void)
+static uint8 locateSOFMarker(pjpeg_context_t *pCtx)
 {
    uint8 c;
 
-   uint8 status = locateSOIMarker();
+   uint8 status = locateSOIMarker(pCtx);
    if (status)
       return status;
    
-   status = processMarkers(&c);
+   status = processMarkers(pCtx, &c);
    if (status)
       return status;
 
@@ -895,13 +1270,24 @@ static uint8 locateSOFMarker(void)
    {
       case M_SOF2:
       {
+#if PJPG_PROGRESSIVE
+         // Progressive JPEG, the scans are decoded into the caller's coefficient
+         // buffer by pjpeg_decode_scans_ctx().
+         status = readSOFMarker(pCtx);
+         if (status)
+            return status;
+
+         pCtx->mProgressive = 1;
+         break;
+#else
          // Progressive JPEG - not supported by picojpeg (would require too
          // much memory, or too many IDCT's for embedded systems).
          return PJPG_UNSUPPORTED_MODE;
+#endif
       }
       case M_SOF0:  /* baseline DCT */
       {
-         status = readSOFMarker();
+         status = readSOFMarker(pCtx);
          if (status)
             return status;
             
@@ -922,14 +1308,14 @@ static uint8 locateSOFMarker(void)
 }
 //------------------------------------------------------------------------------
 // Find a start of scan (SOS) marker.
-static uint8 locateSOSMarker(uint8* pFoundEOI)
+static uint8 locateSOSMarker(pjpeg_context_t *pCtx, uint8* pFoundEOI)
 {
    uint8 c;
    uint8 status;
 
    *pFoundEOI = 0;
       
-   status = processMarkers(&c);
+   status = processMarkers(pCtx, &c);
    if (status)
       return status;
 
@@ -941,48 +1327,53 @@ static uint8 locateSOSMarker(uint8* pFoundEOI)
    else if (c != M_SOS)
       return PJPG_UNEXPECTED_MARKER;
 
-   return readSOSMarker();
+   return readSOSMarker(pCtx);
 }
 //------------------------------------------------------------------------------
-static uint8 init(void)
+static uint8 init(pjpeg_context_t *pCtx, uint8 keepTables)
 {
-   gImageXSize = 0;
-   gImageYSize = 0;
-   gCompsInFrame = 0;
-   gRestartInterval = 0;
-   gCompsInScan = 0;
-   gValidHuffTables = 0;
-   gValidQuantTables = 0;
-   gTemFlag = 0;
-   gInBufOfs = 0;
-   gInBufLeft = 0;
-   gBitBuf = 0;
-   gBitsLeft = 8;
+   pCtx->mImageXSize = 0;
+   pCtx->mImageYSize = 0;
+   pCtx->mCompsInFrame = 0;
+   pCtx->mRestartInterval = 0;
+   pCtx->mCompsInScan = 0;
+   if (!keepTables)
+   {
+      pCtx->mValidHuffTables = 0;
+      pCtx->mValidQuantTables = 0;
+   }
+#if PJPG_PROGRESSIVE
+   pCtx->mProgressive = 0;
+   pCtx->mpCoeffs = (short*)0;
+#endif
+   pCtx->mTemFlag = 0;
+   pCtx->mpInBuf = pCtx->mInBuf;
+   pCtx->mInBufLeft = 0;
+   pCtx->mBitBuf = 0;
+   pCtx->mBitsLeft = 8;
 
-   getBits1(8);
-   getBits1(8);
+   getBits1(pCtx, 8);
+   getBits1(pCtx, 8);
 
    return 0;
 }
 //------------------------------------------------------------------------------
 // This method throws back into the stream any bytes that where read
 // into the bit buffer during initial marker scanning.
-static void fixInBuffer(void)
+static void fixInBuffer(pjpeg_context_t *pCtx)
 {
    /* In case any 0xFF's where pulled into the buffer during marker scanning */
 
-   if (gBitsLeft > 0)  
-      stuffChar((uint8)gBitBuf);
+   if (pCtx->mBitsLeft > 0)  
+      stuffChar(pCtx, (uint8)pCtx->mBitBuf);
    
-   stuffChar((uint8)(gBitBuf >> 8));
+   stuffChar(pCtx, (uint8)(pCtx->mBitBuf >> 8));
    
-   gBitsLeft = 8;
-   getBits2(8);
-   getBits2(8);
+   initEntropyBits(pCtx);
 }
 //------------------------------------------------------------------------------
 // Restart interval processing.
-static uint8 processRestart(void)
+static uint8 processRestart(pjpeg_context_t *pCtx)
 {
    // Let's scan a little bit to find the marker, but not _too_ far.
    // 1536 is a "fudge factor" that determines how much to scan.
@@ -990,37 +1381,41 @@ static uint8 processRestart(void)
    uint8 c = 0;
 
    for (i = 1536; i > 0; i--)
-      if (getChar() == 0xFF)
+      if (getChar(pCtx) == 0xFF)
          break;
 
    if (i == 0)
       return PJPG_BAD_RESTART_MARKER;
    
    for ( ; i > 0; i--)
-      if ((c = getChar()) != 0xFF)
+      if ((c = getChar(pCtx)) != 0xFF)
          break;
 
    if (i == 0)
       return PJPG_BAD_RESTART_MARKER;
 
    // Is it the expected marker? If not, something bad happened.
-   if (c != (gNextRestartNum + M_RST0))
+   if (c != (pCtx->mNextRestartNum + M_RST0))
       return PJPG_BAD_RESTART_MARKER;
 
    // Reset each component's DC prediction values.
-   gLastDC[0] = 0;
-   gLastDC[1] = 0;
-   gLastDC[2] = 0;
+   pCtx->mLastDC[0] = 0;
+   pCtx->mLastDC[1] = 0;
+   pCtx->mLastDC[2] = 0;
+
+#if PJPG_PROGRESSIVE
+   pCtx->mEOBRun = 0;
+#endif
 
-   gRestartsLeft = gRestartInterval;
+   pCtx->mRestartsLeft = pCtx->mRestartInterval;
 
-   gNextRestartNum = (gNextRestartNum + 1) & 7;
+   pCtx->mNextRestartNum = (pCtx->mNextRestartNum + 1) & 7;
+
+   PJPG_STATS_INC(m_restarts);
 
    // Get the bit buffer going again
 
-   gBitsLeft = 8;
-   getBits2(8);
-   getBits2(8);
+   initEntropyBits(pCtx);
    
    return 0;
 }
@@ -1028,22 +1423,22 @@ static uint8 processRestart(void)
 // FIXME: findEOI() is not actually called at the end of the image 
 // (it's optional, and probably not needed on embedded devices)
 /*
-static uint8 findEOI(void)
+static uint8 findEOI(pjpeg_context_t *pCtx)
 {
    uint8 c;
    uint8 status;
 
    // Prime the bit buffer
-   gBitsLeft = 8;
-   getBits1(8);
-   getBits1(8);
+   pCtx->mBitsLeft = 8;
+   getBits1(pCtx, 8);
+   getBits1(pCtx, 8);
 
    // The next marker _should_ be EOI
-   status = processMarkers(&c);
+   status = processMarkers(pCtx, &c);
    if (status)
       return status;
-   else if (gCallbackStatus)
-      return gCallbackStatus;
+   else if (pCtx->mCallbackStatus)
+      return pCtx->mCallbackStatus;
    
    //gTotalBytesRead -= in_buf_left;
    if (c != M_EOI)
@@ -1053,143 +1448,159 @@ static uint8 findEOI(void)
 }
 */
 //------------------------------------------------------------------------------
-static uint8 checkHuffTables(void)
+// Checks the DC or AC Huffman table tab of a scan has been defined.
+static uint8 checkHuffTable(pjpeg_context_t *pCtx, uint8 isAC, uint8 tab)
+{
+   uint8 tableIndex = (uint8)(isAC ? tab + 2 : tab);
+
+#if PJPG_DEFAULT_HUFF_TABLES
+   // Tables that haven't been defined are the standard ones (MJPEG frames)
+   if ((tab < 2) && ((pCtx->mValidHuffTables & (1 << tableIndex)) == 0))
+      loadStdHuffTable(pCtx, tableIndex);
+#endif
+
+   if ((pCtx->mValidHuffTables & (1 << tableIndex)) == 0)
+      return PJPG_UNDEFINED_HUFF_TABLE;
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+static uint8 checkHuffTables(pjpeg_context_t *pCtx)
 {
    uint8 i;
 
-   for (i = 0; i < gCompsInScan; i++)
+   for (i = 0; i < pCtx->mCompsInScan; i++)
    {
-      uint8 compDCTab = gCompDCTab[gCompList[i]];
-      uint8 compACTab = gCompACTab[gCompList[i]] + 2;
-      
-      if ( ((gValidHuffTables & (1 << compDCTab)) == 0) ||
-           ((gValidHuffTables & (1 << compACTab)) == 0) )
+      uint8 compID = pCtx->mCompList[i];
+
+      if ( (checkHuffTable(pCtx, 0, pCtx->mCompDCTab[compID])) ||
+           (checkHuffTable(pCtx, 1, pCtx->mCompACTab[compID])) )
          return PJPG_UNDEFINED_HUFF_TABLE;           
    }
    
    return 0;
 }
 //------------------------------------------------------------------------------
-static uint8 checkQuantTables(void)
+static uint8 checkQuantTables(pjpeg_context_t *pCtx)
 {
    uint8 i;
 
-   for (i = 0; i < gCompsInScan; i++)
+   for (i = 0; i < pCtx->mCompsInScan; i++)
    {
-      uint8 compQuantMask = gCompQuant[gCompList[i]] ? 2 : 1;
+      uint8 compQuantMask = pCtx->mCompQuant[pCtx->mCompList[i]] ? 2 : 1;
       
-      if ((gValidQuantTables & compQuantMask) == 0)
+      if ((pCtx->mValidQuantTables & compQuantMask) == 0)
          return PJPG_UNDEFINED_QUANT_TABLE;
    }         
 
    return 0;         
 }
 //------------------------------------------------------------------------------
-static uint8 initScan(void)
+static uint8 initScan(pjpeg_context_t *pCtx)
 {
    uint8 foundEOI;
-   uint8 status = locateSOSMarker(&foundEOI);
+   uint8 status = locateSOSMarker(pCtx, &foundEOI);
    if (status)
       return status;
    if (foundEOI)
       return PJPG_UNEXPECTED_MARKER;
    
-   status = checkHuffTables();
+   status = checkHuffTables(pCtx);
    if (status)
       return status;
 
-   status = checkQuantTables();
+   status = checkQuantTables(pCtx);
    if (status)
       return status;
 
-   gLastDC[0] = 0;
-   gLastDC[1] = 0;
-   gLastDC[2] = 0;
+   pCtx->mLastDC[0] = 0;
+   pCtx->mLastDC[1] = 0;
+   pCtx->mLastDC[2] = 0;
 
-   if (gRestartInterval)
+   if (pCtx->mRestartInterval)
    {
-      gRestartsLeft = gRestartInterval;
-      gNextRestartNum = 0;
+      pCtx->mRestartsLeft = pCtx->mRestartInterval;
+      pCtx->mNextRestartNum = 0;
    }
 
-   fixInBuffer();
+   fixInBuffer(pCtx);
 
    return 0;
 }
 //------------------------------------------------------------------------------
-static uint8 initFrame(void)
+static uint8 initFrame(pjpeg_context_t *pCtx)
 {
-   if (gCompsInFrame == 1)
+   if (pCtx->mCompsInFrame == 1)
    {
-      if ((gCompHSamp[0] != 1) || (gCompVSamp[0] != 1))
+      if ((pCtx->mCompHSamp[0] != 1) || (pCtx->mCompVSamp[0] != 1))
          return PJPG_UNSUPPORTED_SAMP_FACTORS;
 
-      gScanType = PJPG_GRAYSCALE;
+      pCtx->mScanType = PJPG_GRAYSCALE;
 
-      gMaxBlocksPerMCU = 1;
-      gMCUOrg[0] = 0;
+      pCtx->mMaxBlocksPerMCU = 1;
+      pCtx->mMCUOrg[0] = 0;
 
-      gMaxMCUXSize     = 8;
-      gMaxMCUYSize     = 8;
+      pCtx->mMaxMCUXSize     = 8;
+      pCtx->mMaxMCUYSize     = 8;
    }
-   else if (gCompsInFrame == 3)
+   else if (pCtx->mCompsInFrame == 3)
    {
-      if ( ((gCompHSamp[1] != 1) || (gCompVSamp[1] != 1)) ||
-         ((gCompHSamp[2] != 1) || (gCompVSamp[2] != 1)) )
+      if ( ((pCtx->mCompHSamp[1] != 1) || (pCtx->mCompVSamp[1] != 1)) ||
+         ((pCtx->mCompHSamp[2] != 1) || (pCtx->mCompVSamp[2] != 1)) )
          return PJPG_UNSUPPORTED_SAMP_FACTORS;
 
-      if ((gCompHSamp[0] == 1) && (gCompVSamp[0] == 1))
+      if ((pCtx->mCompHSamp[0] == 1) && (pCtx->mCompVSamp[0] == 1))
       {
-         gScanType = PJPG_YH1V1;
+         pCtx->mScanType = PJPG_YH1V1;
 
-         gMaxBlocksPerMCU = 3;
-         gMCUOrg[0] = 0;
-         gMCUOrg[1] = 1;
-         gMCUOrg[2] = 2;
+         pCtx->mMaxBlocksPerMCU = 3;
+         pCtx->mMCUOrg[0] = 0;
+         pCtx->mMCUOrg[1] = 1;
+         pCtx->mMCUOrg[2] = 2;
                   
-         gMaxMCUXSize = 8;
-         gMaxMCUYSize = 8;
+         pCtx->mMaxMCUXSize = 8;
+         pCtx->mMaxMCUYSize = 8;
       }
-      else if ((gCompHSamp[0] == 1) && (gCompVSamp[0] == 2))
+      else if ((pCtx->mCompHSamp[0] == 1) && (pCtx->mCompVSamp[0] == 2))
       {
-         gScanType = PJPG_YH1V2;
+         pCtx->mScanType = PJPG_YH1V2;
 
-         gMaxBlocksPerMCU = 4;
-         gMCUOrg[0] = 0;
-         gMCUOrg[1] = 0;
-         gMCUOrg[2] = 1;
-         gMCUOrg[3] = 2;
+         pCtx->mMaxBlocksPerMCU = 4;
+         pCtx->mMCUOrg[0] = 0;
+         pCtx->mMCUOrg[1] = 0;
+         pCtx->mMCUOrg[2] = 1;
+         pCtx->mMCUOrg[3] = 2;
 
-         gMaxMCUXSize = 8;
-         gMaxMCUYSize = 16;
+         pCtx->mMaxMCUXSize = 8;
+         pCtx->mMaxMCUYSize = 16;
       }
-      else if ((gCompHSamp[0] == 2) && (gCompVSamp[0] == 1))
+      else if ((pCtx->mCompHSamp[0] == 2) && (pCtx->mCompVSamp[0] == 1))
       {
-         gScanType = PJPG_YH2V1;
+         pCtx->mScanType = PJPG_YH2V1;
 
-         gMaxBlocksPerMCU = 4;
-         gMCUOrg[0] = 0;
-         gMCUOrg[1] = 0;
-         gMCUOrg[2] = 1;
-         gMCUOrg[3] = 2;
+         pCtx->mMaxBlocksPerMCU = 4;
+         pCtx->mMCUOrg[0] = 0;
+         pCtx->mMCUOrg[1] = 0;
+         pCtx->mMCUOrg[2] = 1;
+         pCtx->mMCUOrg[3] = 2;
 
-         gMaxMCUXSize = 16;
-         gMaxMCUYSize = 8;
+         pCtx->mMaxMCUXSize = 16;
+         pCtx->mMaxMCUYSize = 8;
       }
-      else if ((gCompHSamp[0] == 2) && (gCompVSamp[0] == 2))
+      else if ((pCtx->mCompHSamp[0] == 2) && (pCtx->mCompVSamp[0] == 2))
       {
-         gScanType = PJPG_YH2V2;
-
-         gMaxBlocksPerMCU = 6;
-         gMCUOrg[0] = 0;
-         gMCUOrg[1] = 0;
-         gMCUOrg[2] = 0;
-         gMCUOrg[3] = 0;
-         gMCUOrg[4] = 1;
-         gMCUOrg[5] = 2;
-
-         gMaxMCUXSize = 16;
-         gMaxMCUYSize = 16;
+         pCtx->mScanType = PJPG_YH2V2;
+
+         pCtx->mMaxBlocksPerMCU = 6;
+         pCtx->mMCUOrg[0] = 0;
+         pCtx->mMCUOrg[1] = 0;
+         pCtx->mMCUOrg[2] = 0;
+         pCtx->mMCUOrg[3] = 0;
+         pCtx->mMCUOrg[4] = 1;
+         pCtx->mMCUOrg[5] = 2;
+
+         pCtx->mMaxMCUXSize = 16;
+         pCtx->mMaxMCUYSize = 16;
       }
       else
          return PJPG_UNSUPPORTED_SAMP_FACTORS;
@@ -1197,13 +1608,13 @@ static uint8 initFrame(void)
    else
       return PJPG_UNSUPPORTED_COLORSPACE;
 
-   gMaxMCUSPerRow = (gImageXSize + (gMaxMCUXSize - 1)) >> ((gMaxMCUXSize == 8) ? 3 : 4);
-   gMaxMCUSPerCol = (gImageYSize + (gMaxMCUYSize - 1)) >> ((gMaxMCUYSize == 8) ? 3 : 4);
+   pCtx->mMaxMCUSPerRow = (pCtx->mImageXSize + (pCtx->mMaxMCUXSize - 1)) >> ((pCtx->mMaxMCUXSize == 8) ? 3 : 4);
+   pCtx->mMaxMCUSPerCol = (pCtx->mImageYSize + (pCtx->mMaxMCUYSize - 1)) >> ((pCtx->mMaxMCUYSize == 8) ? 3 : 4);
    
    // This can overflow on large JPEG's.
-   //gNumMCUSRemaining = gMaxMCUSPerRow * gMaxMCUSPerCol;
-   gNumMCUSRemainingX = gMaxMCUSPerRow;
-   gNumMCUSRemainingY = gMaxMCUSPerCol;
+   //gNumMCUSRemaining = pCtx->mMaxMCUSPerRow * pCtx->mMaxMCUSPerCol;
+   pCtx->mNumMCUSRemainingX = pCtx->mMaxMCUSPerRow;
+   pCtx->mNumMCUSRemainingY = pCtx->mMaxMCUSPerCol;
    
    return 0;
 }
@@ -1245,6 +1656,7 @@ static void createWinogradQuant(int16* pQuant)
    }
 }
 
+#if !PJPG_SIMD
 // These multiply helper functions are the 4 types of signed multiplies needed by the Winograd IDCT.
 // A smart C compiler will optimize them to use 16x8 = 24 bit muls, if not you may need to tweak
 // these functions or drop to CPU specific inline assembly.
@@ -1284,6 +1696,7 @@ static PJPG_INLINE int16 imul_b5(int16 w)
    x += 128L;
    return (int16)(PJPG_ARITH_SHIFT_RIGHT_8_L(x));
 }
+#endif
 
 static PJPG_INLINE uint8 clamp(int16 s)
 {
@@ -1298,10 +1711,11 @@ static PJPG_INLINE uint8 clamp(int16 s)
    return (uint8)s;
 }
 
-static void idctRows(void)
+#if !PJPG_SIMD
+static void idctRows(pjpeg_context_t *pCtx)
 {
    uint8 i;
-   int16* pSrc = gCoeffBuf;
+   int16* pSrc = pCtx->mCoeffBuf;
             
    for (i = 0; i < 8; i++)
    {
@@ -1310,6 +1724,8 @@ static void idctRows(void)
          // Short circuit the 1D IDCT if only the DC component is non-zero
          int16 src0 = *pSrc;
 
+         PJPG_STATS_INC(m_dcOnlyRows);
+
          *(pSrc+1) = src0;
          *(pSrc+2) = src0;
          *(pSrc+3) = src0;
@@ -1373,11 +1789,11 @@ static void idctRows(void)
    }      
 }
 
-static void idctCols(void)
+static void idctCols(pjpeg_context_t *pCtx)
 {
    uint8 i;
       
-   int16* pSrc = gCoeffBuf;
+   int16* pSrc = pCtx->mCoeffBuf;
    
    for (i = 0; i < 8; i++)
    {
@@ -1385,6 +1801,8 @@ static void idctCols(void)
       {
          // Short circuit the 1D IDCT if only the DC component is non-zero
          uint8 c = clamp(PJPG_DESCALE(*pSrc) + 128);
+
+         PJPG_STATS_INC(m_dcOnlyCols);
          *(pSrc+0*8) = c;
          *(pSrc+1*8) = c;
          *(pSrc+2*8) = c;
@@ -1449,37 +1867,209 @@ static void idctCols(void)
       pSrc++;      
    }      
 }
+#else // PJPG_SIMD
+//------------------------------------------------------------------------------
+// SSE2/NEON IDCT, the same Winograd IDCT as above (without the DC only short
+// cuts, which give the same result) run on 8 rows or columns at once. Every
+// step wraps to 16 bits and rounds exactly as the portable code does, so the
+// output is bit identical.
+#if PJPG_NEON
+typedef int16x8_t pjpeg_v16;
+
+#define simdLoad(p)     vld1q_s16(p)
+#define simdStore(p, v) vst1q_s16(p, v)
+#define simdSet(k)      vdupq_n_s16(k)
+#define simdAdd(a, b)   vaddq_s16(a, b)
+#define simdSub(a, b)   vsubq_s16(a, b)
+
+// (int16)((w * k + 128) >> 8) as imul_b1_b3() etc.
+static PJPG_INLINE pjpeg_v16 simdMul(pjpeg_v16 w, int16 k)
+{
+   int16x4_t kk = vdup_n_s16(k);
+   return vcombine_s16(vrshrn_n_s32(vmull_s16(vget_low_s16(w), kk), 8), vrshrn_n_s32(vmull_s16(vget_high_s16(w), kk), 8));
+}
 
-/*----------------------------------------------------------------------------*/
-static PJPG_INLINE uint8 addAndClamp(uint8 a, int16 b)
+// clamp(PJPG_DESCALE(x) + 128), the rounding add wraps as in the portable code
+static PJPG_INLINE pjpeg_v16 simdDescaleClamp(pjpeg_v16 x)
 {
-   b = a + b;
-   
-   if ((uint16)b > 255U)
-   {
-      if (b < 0)
-         return 0;
-      else if (b > 255)
-         return 255;
-   }
-      
-   return (uint8)b;
+   x = vshrq_n_s16(vaddq_s16(x, vdupq_n_s16(1 << (PJPG_DCT_SCALE_BITS - 1))), PJPG_DCT_SCALE_BITS);
+   x = vaddq_s16(x, vdupq_n_s16(128));
+   return vminq_s16(vmaxq_s16(x, vdupq_n_s16(0)), vdupq_n_s16(255));
 }
-/*----------------------------------------------------------------------------*/
-static PJPG_INLINE uint8 subAndClamp(uint8 a, int16 b)
+
+static void simdTranspose(pjpeg_v16* r)
 {
-   b = a - b;
+   int16x8x2_t t0 = vtrnq_s16(r[0], r[1]);
+   int16x8x2_t t1 = vtrnq_s16(r[2], r[3]);
+   int16x8x2_t t2 = vtrnq_s16(r[4], r[5]);
+   int16x8x2_t t3 = vtrnq_s16(r[6], r[7]);
+   int32x4x2_t u0 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[0]), vreinterpretq_s32_s16(t1.val[0]));
+   int32x4x2_t u1 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[1]), vreinterpretq_s32_s16(t1.val[1]));
+   int32x4x2_t u2 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[0]), vreinterpretq_s32_s16(t3.val[0]));
+   int32x4x2_t u3 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[1]), vreinterpretq_s32_s16(t3.val[1]));
+
+   r[0] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u0.val[0]), vget_low_s32(u2.val[0])));
+   r[1] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u1.val[0]), vget_low_s32(u3.val[0])));
+   r[2] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u0.val[1]), vget_low_s32(u2.val[1])));
+   r[3] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(u1.val[1]), vget_low_s32(u3.val[1])));
+   r[4] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u0.val[0]), vget_high_s32(u2.val[0])));
+   r[5] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u1.val[0]), vget_high_s32(u3.val[0])));
+   r[6] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u0.val[1]), vget_high_s32(u2.val[1])));
+   r[7] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(u1.val[1]), vget_high_s32(u3.val[1])));
+}
+#else
+typedef __m128i pjpeg_v16;
 
-   if ((uint16)b > 255U)
-   {
-      if (b < 0)
-         return 0;
-      else if (b > 255)
-         return 255;
+#define simdLoad(p)     _mm_loadu_si128((const __m128i*)(p))
+#define simdStore(p, v) _mm_storeu_si128((__m128i*)(p), v)
+#define simdSet(k)      _mm_set1_epi16(k)
+#define simdAdd(a, b)   _mm_add_epi16(a, b)
+#define simdSub(a, b)   _mm_sub_epi16(a, b)
+
+// (int16)((w * k + 128) >> 8) as imul_b1_b3() etc. That's bits 8-23 of the product,
+// plus its bit 7 for the rounding.
+static PJPG_INLINE pjpeg_v16 simdMul(pjpeg_v16 w, int16 k)
+{
+   __m128i kk = _mm_set1_epi16(k);
+   __m128i lo = _mm_mullo_epi16(w, kk);
+   __m128i hi = _mm_mulhi_epi16(w, kk);
+   __m128i r = _mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(lo, 8));
+   return _mm_add_epi16(r, _mm_and_si128(_mm_srli_epi16(lo, 7), _mm_set1_epi16(1)));
+}
+
+// clamp(PJPG_DESCALE(x) + 128), the rounding add wraps as in the portable code
+static PJPG_INLINE pjpeg_v16 simdDescaleClamp(pjpeg_v16 x)
+{
+   x = _mm_srai_epi16(_mm_add_epi16(x, _mm_set1_epi16(1 << (PJPG_DCT_SCALE_BITS - 1))), PJPG_DCT_SCALE_BITS);
+   x = _mm_add_epi16(x, _mm_set1_epi16(128));
+   return _mm_min_epi16(_mm_max_epi16(x, _mm_setzero_si128()), _mm_set1_epi16(255));
+}
+
+static void simdTranspose(pjpeg_v16* r)
+{
+   __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+   __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+   __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+   __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+   __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+   __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+   __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+   __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+   __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+   __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+   __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+   __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+   __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+   __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+   __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+   __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+   r[0] = _mm_unpacklo_epi64(b0, b4);
+   r[1] = _mm_unpackhi_epi64(b0, b4);
+   r[2] = _mm_unpacklo_epi64(b1, b5);
+   r[3] = _mm_unpackhi_epi64(b1, b5);
+   r[4] = _mm_unpacklo_epi64(b2, b6);
+   r[5] = _mm_unpackhi_epi64(b2, b6);
+   r[6] = _mm_unpacklo_epi64(b3, b7);
+   r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+#endif
+
+// 1D IDCT of the 8 vectors, lane by lane, as in idctRows()
+static void simdIDCT1D(pjpeg_v16* s)
+{
+   pjpeg_v16 x4 = simdSub(s[5], s[3]);
+   pjpeg_v16 x7 = simdAdd(s[5], s[3]);
+   pjpeg_v16 x5 = simdAdd(s[1], s[7]);
+   pjpeg_v16 x6 = simdSub(s[1], s[7]);
+
+   pjpeg_v16 tmp1 = simdMul(simdSub(x4, x6), 196);
+   pjpeg_v16 stg26 = simdSub(simdMul(x6, 277), tmp1);
+
+   pjpeg_v16 x24 = simdSub(tmp1, simdMul(x4, 669));
+
+   pjpeg_v16 x15 = simdSub(x5, x7);
+   pjpeg_v16 x17 = simdAdd(x5, x7);
+
+   pjpeg_v16 tmp2 = simdSub(stg26, x17);
+   pjpeg_v16 tmp3 = simdSub(simdMul(x15, 362), tmp2);
+   pjpeg_v16 x44 = simdAdd(tmp3, x24);
+
+   pjpeg_v16 x30 = simdAdd(s[0], s[4]);
+   pjpeg_v16 x31 = simdSub(s[0], s[4]);
+
+   pjpeg_v16 x12 = simdSub(s[2], s[6]);
+   pjpeg_v16 x13 = simdAdd(s[2], s[6]);
+
+   pjpeg_v16 x32 = simdSub(simdMul(x12, 362), x13);
+
+   pjpeg_v16 x40 = simdAdd(x30, x13);
+   pjpeg_v16 x43 = simdSub(x30, x13);
+   pjpeg_v16 x41 = simdAdd(x31, x32);
+   pjpeg_v16 x42 = simdSub(x31, x32);
+
+   s[0] = simdAdd(x40, x17);
+   s[1] = simdAdd(x41, tmp2);
+   s[2] = simdAdd(x42, tmp3);
+   s[3] = simdSub(x43, x44);
+   s[4] = simdAdd(x43, x44);
+   s[5] = simdSub(x42, tmp3);
+   s[6] = simdSub(x41, tmp2);
+   s[7] = simdSub(x40, x17);
+}
+
+// Replaces idctRows() and idctCols(). The rows are transposed so each lane does a
+// row, and transposed back for the columns.
+static void idctSimd(pjpeg_context_t *pCtx)
+{
+   pjpeg_v16 r[8];
+   uint8 i;
+
+   for (i = 0; i < 8; i++)
+      r[i] = simdLoad(pCtx->mCoeffBuf + i * 8);
+
+   simdTranspose(r);
+   simdIDCT1D(r);
+   simdTranspose(r);
+   simdIDCT1D(r);
+
+   for (i = 0; i < 8; i++)
+      simdStore(pCtx->mCoeffBuf + i * 8, simdDescaleClamp(r[i]));
+}
+#endif // PJPG_SIMD
+
+/*----------------------------------------------------------------------------*/
+static PJPG_INLINE uint8 addAndClamp(uint8 a, int16 b)
+{
+   b = a + b;
+   
+   if ((uint16)b > 255U)
+   {
+      if (b < 0)
+         return 0;
+      else if (b > 255)
+         return 255;
+   }
+      
+   return (uint8)b;
+}
+/*----------------------------------------------------------------------------*/
+static PJPG_INLINE uint8 subAndClamp(uint8 a, int16 b)
+{
+   b = a - b;
+
+   if ((uint16)b > 255U)
+   {
+      if (b < 0)
+         return 0;
+      else if (b > 255)
+         return 255;
    }
 
    return (uint8)b;
 }
+#if !PJPG_SIMD
 /*----------------------------------------------------------------------------*/
 // 103/256
 //R = Y + 1.402 (Cr-128)
@@ -1491,13 +2081,13 @@ static PJPG_INLINE uint8 subAndClamp(uint8 a, int16 b)
 //B = Y + 1.772 (Cb-128)
 /*----------------------------------------------------------------------------*/
 // Cb upsample and accumulate, 4x4 to 8x8
-static void upsampleCb(uint8 srcOfs, uint8 dstOfs)
+static void upsampleCb(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)
 {
    // Cb - affects G and B
    uint8 x, y;
-   int16* pSrc = gCoeffBuf + srcOfs;
-   uint8* pDstG = gMCUBufG + dstOfs;
-   uint8* pDstB = gMCUBufB + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf + srcOfs;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
+   uint8* pDstB = pCtx->mMCUBufB + dstOfs;
    for (y = 0; y < 4; y++)
    {
       for (x = 0; x < 4; x++)
@@ -1528,13 +2118,13 @@ static void upsampleCb(uint8 srcOfs, uint8 dstOfs)
 }   
 /*----------------------------------------------------------------------------*/
 // Cb upsample and accumulate, 4x8 to 8x8
-static void upsampleCbH(uint8 srcOfs, uint8 dstOfs)
+static void upsampleCbH(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)
 {
    // Cb - affects G and B
    uint8 x, y;
-   int16* pSrc = gCoeffBuf + srcOfs;
-   uint8* pDstG = gMCUBufG + dstOfs;
-   uint8* pDstB = gMCUBufB + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf + srcOfs;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
+   uint8* pDstB = pCtx->mMCUBufB + dstOfs;
    for (y = 0; y < 8; y++)
    {
       for (x = 0; x < 4; x++)
@@ -1559,13 +2149,13 @@ static void upsampleCbH(uint8 srcOfs, uint8 dstOfs)
 }   
 /*----------------------------------------------------------------------------*/
 // Cb upsample and accumulate, 8x4 to 8x8
-static void upsampleCbV(uint8 srcOfs, uint8 dstOfs)
+static void upsampleCbV(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)
 {
    // Cb - affects G and B
    uint8 x, y;
-   int16* pSrc = gCoeffBuf + srcOfs;
-   uint8* pDstG = gMCUBufG + dstOfs;
-   uint8* pDstB = gMCUBufB + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf + srcOfs;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
+   uint8* pDstB = pCtx->mMCUBufB + dstOfs;
    for (y = 0; y < 4; y++)
    {
       for (x = 0; x < 8; x++)
@@ -1600,13 +2190,13 @@ static void upsampleCbV(uint8 srcOfs, uint8 dstOfs)
 //B = Y + 1.772 (Cb-128)
 /*----------------------------------------------------------------------------*/
 // Cr upsample and accumulate, 4x4 to 8x8
-static void upsampleCr(uint8 srcOfs, uint8 dstOfs)
+static void upsampleCr(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)
 {
    // Cr - affects R and G
    uint8 x, y;
-   int16* pSrc = gCoeffBuf + srcOfs;
-   uint8* pDstR = gMCUBufR + dstOfs;
-   uint8* pDstG = gMCUBufG + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf + srcOfs;
+   uint8* pDstR = pCtx->mMCUBufR + dstOfs;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
    for (y = 0; y < 4; y++)
    {
       for (x = 0; x < 4; x++)
@@ -1637,13 +2227,13 @@ static void upsampleCr(uint8 srcOfs, uint8 dstOfs)
 }   
 /*----------------------------------------------------------------------------*/
 // Cr upsample and accumulate, 4x8 to 8x8
-static void upsampleCrH(uint8 srcOfs, uint8 dstOfs)
+static void upsampleCrH(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)
 {
    // Cr - affects R and G
    uint8 x, y;
-   int16* pSrc = gCoeffBuf + srcOfs;
-   uint8* pDstR = gMCUBufR + dstOfs;
-   uint8* pDstG = gMCUBufG + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf + srcOfs;
+   uint8* pDstR = pCtx->mMCUBufR + dstOfs;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
    for (y = 0; y < 8; y++)
    {
       for (x = 0; x < 4; x++)
@@ -1668,13 +2258,13 @@ static void upsampleCrH(uint8 srcOfs, uint8 dstOfs)
 }   
 /*----------------------------------------------------------------------------*/
 // Cr upsample and accumulate, 8x4 to 8x8
-static void upsampleCrV(uint8 srcOfs, uint8 dstOfs)
+static void upsampleCrV(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)
 {
    // Cr - affects R and G
    uint8 x, y;
-   int16* pSrc = gCoeffBuf + srcOfs;
-   uint8* pDstR = gMCUBufR + dstOfs;
-   uint8* pDstG = gMCUBufG + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf + srcOfs;
+   uint8* pDstR = pCtx->mMCUBufR + dstOfs;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
    for (y = 0; y < 4; y++)
    {
       for (x = 0; x < 8; x++)
@@ -1700,13 +2290,13 @@ static void upsampleCrV(uint8 srcOfs, uint8 dstOfs)
 } 
 /*----------------------------------------------------------------------------*/
 // Convert Y to RGB
-static void copyY(uint8 dstOfs)
+static void copyY(pjpeg_context_t *pCtx, uint8 dstOfs)
 {
    uint8 i;
-   uint8* pRDst = gMCUBufR + dstOfs;
-   uint8* pGDst = gMCUBufG + dstOfs;
-   uint8* pBDst = gMCUBufB + dstOfs;
-   int16* pSrc = gCoeffBuf;
+   uint8* pRDst = pCtx->mMCUBufR + dstOfs;
+   uint8* pGDst = pCtx->mMCUBufG + dstOfs;
+   uint8* pBDst = pCtx->mMCUBufB + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf;
    
    for (i = 64; i > 0; i--)
    {
@@ -1719,12 +2309,12 @@ static void copyY(uint8 dstOfs)
 }
 /*----------------------------------------------------------------------------*/
 // Cb convert to RGB and accumulate
-static void convertCb(uint8 dstOfs)
+static void convertCb(pjpeg_context_t *pCtx, uint8 dstOfs)
 {
    uint8 i;
-   uint8* pDstG = gMCUBufG + dstOfs;
-   uint8* pDstB = gMCUBufB + dstOfs;
-   int16* pSrc = gCoeffBuf;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
+   uint8* pDstB = pCtx->mMCUBufB + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf;
 
    for (i = 64; i > 0; i--)
    {
@@ -1743,12 +2333,12 @@ static void convertCb(uint8 dstOfs)
 }
 /*----------------------------------------------------------------------------*/
 // Cr convert to RGB and accumulate
-static void convertCr(uint8 dstOfs)
+static void convertCr(pjpeg_context_t *pCtx, uint8 dstOfs)
 {
    uint8 i;
-   uint8* pDstR = gMCUBufR + dstOfs;
-   uint8* pDstG = gMCUBufG + dstOfs;
-   int16* pSrc = gCoeffBuf;
+   uint8* pDstR = pCtx->mMCUBufR + dstOfs;
+   uint8* pDstG = pCtx->mMCUBufG + dstOfs;
+   int16* pSrc = pCtx->mCoeffBuf;
 
    for (i = 64; i > 0; i--)
    {
@@ -1765,414 +2355,839 @@ static void convertCr(uint8 dstOfs)
       ++pDstG;
       }
 }
+#else // PJPG_SIMD
 /*----------------------------------------------------------------------------*/
-static void transformBlock(uint8 mcuBlock)
+// SSE2/NEON colour conversion, 8 pixels at a time with the same fixed point
+// maths and clamping as above. G's Cb and Cr terms are negated so every plane
+// is added to.
+#if PJPG_NEON
+// *pDst = clamp(*pDst + v) for a row of 8 pixels
+static PJPG_INLINE void simdAccumRow(uint8* pDst, pjpeg_v16 v)
 {
-   idctRows();
-   idctCols();
-   
-   switch (gScanType)
+   int16x8_t d = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pDst)));
+   vst1_u8(pDst, vqmovun_s16(vaddq_s16(d, v)));
+}
+
+// Clamps two rows of 8 to bytes and stores them
+static PJPG_INLINE void simdPackRows(uint8* pDst, pjpeg_v16 a, pjpeg_v16 b)
+{
+   vst1q_u8(pDst, vcombine_u8(vqmovun_s16(a), vqmovun_s16(b)));
+}
+
+// Loads 4 values, each repeated twice
+static PJPG_INLINE pjpeg_v16 simdLoad4x2(const int16* p)
+{
+   int16x4_t v = vld1_s16(p);
+   int16x4x2_t z = vzip_s16(v, v);
+   return vcombine_s16(z.val[0], z.val[1]);
+}
+
+// (c * k) >> 8 for c of 0-255
+#define simdMulU8(c, k) vreinterpretq_s16_u16(vshrq_n_u16(vmulq_n_u16(vreinterpretq_u16_s16(c), k), 8))
+#else
+static PJPG_INLINE void simdAccumRow(uint8* pDst, pjpeg_v16 v)
+{
+   __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)pDst), _mm_setzero_si128());
+   _mm_storel_epi64((__m128i*)pDst, _mm_packus_epi16(_mm_add_epi16(d, v), d));
+}
+
+static PJPG_INLINE void simdPackRows(uint8* pDst, pjpeg_v16 a, pjpeg_v16 b)
+{
+   _mm_storeu_si128((__m128i*)pDst, _mm_packus_epi16(a, b));
+}
+
+static PJPG_INLINE pjpeg_v16 simdLoad4x2(const int16* p)
+{
+   __m128i v = _mm_loadl_epi64((const __m128i*)p);
+   return _mm_unpacklo_epi16(v, v);
+}
+
+#define simdMulU8(c, k) _mm_srli_epi16(_mm_mullo_epi16(c, _mm_set1_epi16(k)), 8)
+#endif
+
+// Adds a Cb or Cr block to the MCU's RGB. If h is 1 each row of 4 values is doubled
+// horizontally, if v is 1 each row is used for 2 rows of pixels.
+static void simdChroma(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs, uint8 isCr, uint8 h, uint8 v)
+{
+   uint8 y;
+   const int16* pSrc = pCtx->mCoeffBuf + srcOfs;
+   uint8* pDst0 = (isCr ? pCtx->mMCUBufR : pCtx->mMCUBufG) + dstOfs;
+   uint8* pDst1 = (isCr ? pCtx->mMCUBufG : pCtx->mMCUBufB) + dstOfs;
+
+   for (y = 0; y < (v ? 4 : 8); y++)
    {
-      case PJPG_GRAYSCALE:
+      pjpeg_v16 c = h ? simdLoad4x2(pSrc) : simdLoad(pSrc);
+      pjpeg_v16 c0, c1;
+
+      if (isCr)
       {
-         // MCU size: 1, 1 block per MCU
-         copyY(0);
-         break;
+         c0 = simdSub(simdAdd(c, simdMulU8(c, 103)), simdSet(179)); // R
+         c1 = simdSub(simdSet(91), simdMulU8(c, 183));              // G
       }
-      case PJPG_YH1V1:
+      else
       {
-         // MCU size: 8x8, 3 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               copyY(0);
-               break;
-            }
-            case 1:
-            {
-               convertCb(0);
-               break;
-            }
-            case 2:
-            {
-               convertCr(0);
-               break;
-            }
-         }
-
-         break;
+         c0 = simdSub(simdSet(44), simdMulU8(c, 88));               // G
+         c1 = simdSub(simdAdd(c, simdMulU8(c, 198)), simdSet(227)); // B
       }
-      case PJPG_YH1V2:
-      {
-         // MCU size: 8x16, 4 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               copyY(0);
-               break;
-            }
-            case 1:
-            {
-               copyY(128);
-               break;
-            }
-            case 2:
-            {
-               upsampleCbV(0, 0);
-               upsampleCbV(4*8, 128);
-               break;
-            }
-            case 3:
-            {
-               upsampleCrV(0, 0);
-               upsampleCrV(4*8, 128);
-               break;
-            }
-         }
 
-         break;
-      }        
-      case PJPG_YH2V1:
-      {
-         // MCU size: 16x8, 4 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               copyY(0);
-               break;
-            }
-            case 1:
-            {
-               copyY(64);
-               break;
-            }
-            case 2:
-            {
-               upsampleCbH(0, 0);
-               upsampleCbH(4, 64);
-               break;
-            }
-            case 3:
-            {
-               upsampleCrH(0, 0);
-               upsampleCrH(4, 64);
-               break;
-            }
-         }
-         
-         break;
-      }        
-      case PJPG_YH2V2:
+      simdAccumRow(pDst0, c0);
+      simdAccumRow(pDst1, c1);
+      pDst0 += 8;
+      pDst1 += 8;
+
+      if (v)
       {
-         // MCU size: 16x16, 6 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               copyY(0);
-               break;
-            }
-            case 1:
-            {
-               copyY(64);
-               break;
-            }
-            case 2:
-            {
-               copyY(128);
-               break;
-            }
-            case 3:
-            {
-               copyY(192);
-               break;
-            }
-            case 4:
-            {
-               upsampleCb(0, 0);
-               upsampleCb(4, 64);
-               upsampleCb(4*8, 128);
-               upsampleCb(4+4*8, 192);
-               break;
-            }
-            case 5:
-            {
-               upsampleCr(0, 0);
-               upsampleCr(4, 64);
-               upsampleCr(4*8, 128);
-               upsampleCr(4+4*8, 192);
-               break;
-            }
-         }
+         simdAccumRow(pDst0, c0);
+         simdAccumRow(pDst1, c1);
+         pDst0 += 8;
+         pDst1 += 8;
+      }
 
-         break;
-      }         
-   }      
+      pSrc += 8;
+   }
 }
-//------------------------------------------------------------------------------
-static void transformBlockReduce(uint8 mcuBlock)
+
+static void upsampleCb(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)  { simdChroma(pCtx, srcOfs, dstOfs, 0, 1, 1); }
+static void upsampleCbH(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs) { simdChroma(pCtx, srcOfs, dstOfs, 0, 1, 0); }
+static void upsampleCbV(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs) { simdChroma(pCtx, srcOfs, dstOfs, 0, 0, 1); }
+static void upsampleCr(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs)  { simdChroma(pCtx, srcOfs, dstOfs, 1, 1, 1); }
+static void upsampleCrH(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs) { simdChroma(pCtx, srcOfs, dstOfs, 1, 1, 0); }
+static void upsampleCrV(pjpeg_context_t *pCtx, uint8 srcOfs, uint8 dstOfs) { simdChroma(pCtx, srcOfs, dstOfs, 1, 0, 1); }
+static void convertCb(pjpeg_context_t *pCtx, uint8 dstOfs) { simdChroma(pCtx, 0, dstOfs, 0, 0, 0); }
+static void convertCr(pjpeg_context_t *pCtx, uint8 dstOfs) { simdChroma(pCtx, 0, dstOfs, 1, 0, 0); }
+/*----------------------------------------------------------------------------*/
+static void copyY(pjpeg_context_t *pCtx, uint8 dstOfs)
 {
-   uint8 c = clamp(PJPG_DESCALE(gCoeffBuf[0]) + 128);
-   int16 cbG, cbB, crR, crG;
+   uint8 i;
 
-   switch (gScanType)
+   for (i = 0; i < 64; i += 16)
    {
-      case PJPG_GRAYSCALE:
-      {
-         // MCU size: 1, 1 block per MCU
-         gMCUBufR[0] = c;
-         break;
-      }
-      case PJPG_YH1V1:
-      {
-         // MCU size: 8x8, 3 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               gMCUBufR[0] = c;
-               gMCUBufG[0] = c;
-               gMCUBufB[0] = c;
-               break;
-            }
-            case 1:
-            {
-               cbG = ((c * 88U) >> 8U) - 44U;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], cbG);
+      pjpeg_v16 a = simdLoad(pCtx->mCoeffBuf + i);
+      pjpeg_v16 b = simdLoad(pCtx->mCoeffBuf + i + 8);
 
-               cbB = (c + ((c * 198U) >> 8U)) - 227U;
-               gMCUBufB[0] = addAndClamp(gMCUBufB[0], cbB);
-               break;
-            }
-            case 2:
-            {
-               crR = (c + ((c * 103U) >> 8U)) - 179;
-               gMCUBufR[0] = addAndClamp(gMCUBufR[0], crR);
+      simdPackRows(pCtx->mMCUBufR + dstOfs + i, a, b);
+      simdPackRows(pCtx->mMCUBufG + dstOfs + i, a, b);
+      simdPackRows(pCtx->mMCUBufB + dstOfs + i, a, b);
+   }
+}
+/*----------------------------------------------------------------------------*/
+// 8 RGB565 pixels of a row from PJPG_OUTPUT_YCBCR planes for pjpeg_mcu_to_rgb565_ctx().
+#if PJPG_NEON
+#define simdLoadU8(p)     vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)))
+#define simdLoadU8x2(p)   vreinterpretq_s16_u16(vmovl_u8(vzip_u8(vld1_u8(p), vld1_u8(p)).val[0]))
+#define simdClampU8(v)    vminq_s16(vmaxq_s16(v, vdupq_n_s16(0)), vdupq_n_s16(255))
+#define simdShl(v, n)     vshlq_n_s16(v, n)
+#define simdShr(v, n)     vreinterpretq_s16_u16(vshrq_n_u16(vreinterpretq_u16_s16(v), n))
+#define simdAnd(v, k)     vandq_s16(v, vdupq_n_s16(k))
+#define simdOr(a, b)      vorrq_s16(a, b)
+#define simdPrev(v)       vextq_s16(vdupq_n_s16(vgetq_lane_s16(v, 0)), v, 7)  // v[i - 1], v[0] repeated
+#define simdNext(v)       vextq_s16(v, vdupq_n_s16(vgetq_lane_s16(v, 7)), 1)  // v[i + 1], v[7] repeated
+#define simdZip(a, b, lo, hi) { int16x8x2_t z_ = vzipq_s16(a, b); lo = z_.val[0]; hi = z_.val[1]; }
+#else
+#define simdLoadU8(p)     _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(p)), _mm_setzero_si128())
+#define simdClampU8(v)    _mm_min_epi16(_mm_max_epi16(v, _mm_setzero_si128()), _mm_set1_epi16(255))
+#define simdShl(v, n)     _mm_slli_epi16(v, n)
+#define simdShr(v, n)     _mm_srli_epi16(v, n)
+#define simdAnd(v, k)     _mm_and_si128(v, _mm_set1_epi16(k))
+#define simdOr(a, b)      _mm_or_si128(a, b)
+#define simdPrev(v)       _mm_insert_epi16(_mm_slli_si128(v, 2), _mm_extract_epi16(v, 0), 0)
+#define simdNext(v)       _mm_insert_epi16(_mm_srli_si128(v, 2), _mm_extract_epi16(v, 7), 7)
+#define simdZip(a, b, lo, hi) { lo = _mm_unpacklo_epi16(a, b); hi = _mm_unpackhi_epi16(a, b); }
+
+static PJPG_INLINE pjpeg_v16 simdLoadU8x2(const uint8* p)
+{
+   __m128i v = _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24));
+   return _mm_unpacklo_epi8(_mm_unpacklo_epi8(v, v), _mm_setzero_si128());
+}
+#endif
 
-               crG = ((c * 183U) >> 8U) - 91;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], crG);
-               break;
-            }
-         }
+static void simdRGB565Row(unsigned short* pOut, const uint8* pY, const uint8* pCb, const uint8* pCr, uint8 h, uint8 gray, uint8 swap)
+{
+   pjpeg_v16 l = simdLoadU8(pY);
+   pjpeg_v16 r = l, g = l, b = l, c;
 
-         break;
-      }
-      case PJPG_YH1V2:
-      {
-         // MCU size: 8x16, 4 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               gMCUBufR[0] = c;
-               gMCUBufG[0] = c;
-               gMCUBufB[0] = c;
-               break;
-            }
-            case 1:
-            {
-               gMCUBufR[128] = c;
-               gMCUBufG[128] = c;
-               gMCUBufB[128] = c;
-               break;
-            }
-            case 2:
-            {
-               cbG = ((c * 88U) >> 8U) - 44U;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], cbG);
-               gMCUBufG[128] = subAndClamp(gMCUBufG[128], cbG);
+   if (!gray)
+   {
+      c = h ? simdLoadU8x2(pCr) : simdLoadU8(pCr);
+      r = simdClampU8(simdAdd(l, simdSub(simdAdd(c, simdMulU8(c, 103)), simdSet(179))));
+      g = simdSub(simdMulU8(c, 183), simdSet(91));
 
-               cbB = (c + ((c * 198U) >> 8U)) - 227U;
-               gMCUBufB[0] = addAndClamp(gMCUBufB[0], cbB);
-               gMCUBufB[128] = addAndClamp(gMCUBufB[128], cbB);
+      c = h ? simdLoadU8x2(pCb) : simdLoadU8(pCb);
+      g = simdClampU8(simdSub(simdClampU8(simdSub(l, simdSub(simdMulU8(c, 88), simdSet(44)))), g));
+      b = simdClampU8(simdAdd(l, simdSub(simdAdd(c, simdMulU8(c, 198)), simdSet(227))));
+   }
 
-               break;
-            }
-            case 3:
-            {
-               crR = (c + ((c * 103U) >> 8U)) - 179;
-               gMCUBufR[0] = addAndClamp(gMCUBufR[0], crR);
-               gMCUBufR[128] = addAndClamp(gMCUBufR[128], crR);
+   c = simdOr(simdOr(simdShl(simdAnd(r, 0xF8), 8), simdShl(simdAnd(g, 0xFC), 3)), simdShr(b, 3));
+   if (swap)
+      c = simdOr(simdShr(c, 8), simdShl(c, 8));
 
-               crG = ((c * 183U) >> 8U) - 91;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], crG);
-               gMCUBufG[128] = subAndClamp(gMCUBufG[128], crG);
+   simdStore((int16*)pOut, c);
+}
 
-               break;
-            }
-         }
-         break;
-      }
-      case PJPG_YH2V1:
-      {
-         // MCU size: 16x8, 4 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               gMCUBufR[0] = c;
-               gMCUBufG[0] = c;
-               gMCUBufB[0] = c;
-               break;
-            }
-            case 1:
-            {
-               gMCUBufR[64] = c;
-               gMCUBufG[64] = c;
-               gMCUBufB[64] = c;
-               break;
-            }
-            case 2:
-            {
-               cbG = ((c * 88U) >> 8U) - 44U;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], cbG);
-               gMCUBufG[64] = subAndClamp(gMCUBufG[64], cbG);
+// fancyChroma() for a full size chroma row, pNear and pFar are the rows to blend
+static void simdFancyChroma(uint8* pOut, const uint8* pNear, const uint8* pFar, uint8 h)
+{
+   pjpeg_v16 c = simdLoadU8(pNear);
+   pjpeg_v16 s = simdAdd(simdAdd(c, c), simdAdd(c, simdLoadU8(pFar)));
+   pjpeg_v16 even, odd;
 
-               cbB = (c + ((c * 198U) >> 8U)) - 227U;
-               gMCUBufB[0] = addAndClamp(gMCUBufB[0], cbB);
-               gMCUBufB[64] = addAndClamp(gMCUBufB[64], cbB);
+   if (!h)
+   {
+      c = simdShr(simdAdd(s, simdSet(2)), 2);
+      simdPackRows(pOut, c, c);
+      return;
+   }
 
-               break;
-            }
-            case 3:
-            {
-               crR = (c + ((c * 103U) >> 8U)) - 179;
-               gMCUBufR[0] = addAndClamp(gMCUBufR[0], crR);
-               gMCUBufR[64] = addAndClamp(gMCUBufR[64], crR);
+   c = simdAdd(simdAdd(s, s), s);
+   even = simdShr(simdAdd(simdAdd(c, simdPrev(s)), simdSet(8)), 4);
+   odd = simdShr(simdAdd(simdAdd(c, simdNext(s)), simdSet(7)), 4);
+   simdZip(even, odd, c, s);
+   simdPackRows(pOut, c, s);
+}
+#endif // PJPG_SIMD
+/*----------------------------------------------------------------------------*/
+// PJPG_OUTPUT_YCBCR, the block's n x n pixels are kept for pjpeg_mcu_to_rgb565_ctx():
+// Y in mMCUBufR at the block's usual offset, Cb and Cr in the first 64 bytes of
+// mMCUBufG and mMCUBufB, all 8 bytes per row. The MCU's numY Y blocks are yStep
+// bytes apart, Cb and Cr are the two blocks after them.
+static void storeYCbCr(pjpeg_context_t *pCtx, uint8 mcuBlock, uint8 n, uint8 numY, uint8 yStep)
+{
+   uint8* pDst;
+   uint8 x, y;
 
-               crG = ((c * 183U) >> 8U) - 91;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], crG);
-               gMCUBufG[64] = subAndClamp(gMCUBufG[64], crG);
+   if (mcuBlock < numY)
+      pDst = pCtx->mMCUBufR + (uint8)(mcuBlock * yStep);
+   else
+      pDst = (mcuBlock == numY) ? pCtx->mMCUBufG : pCtx->mMCUBufB;
 
-               break;
-            }
-         }
+#if PJPG_SIMD
+   if (n == 8)
+   {
+      for (y = 0; y < 64; y += 16)
+         simdPackRows(pDst + y, simdLoad(pCtx->mCoeffBuf + y), simdLoad(pCtx->mCoeffBuf + y + 8));
+      return;
+   }
+#endif
+
+   for (y = 0; y < n; y++)
+      for (x = 0; x < n; x++)
+         pDst[y * 8 + x] = (uint8)pCtx->mCoeffBuf[y * 8 + x];
+}
+/*----------------------------------------------------------------------------*/
+// The block transforms. selectTransform() picks one for the image, so that the output
+// mode, reduce mode and scan type aren't tested again for every block, and each is
+// passed the block's index in the MCU (its Y blocks in raster order, then Cb and Cr).
+static void idctBlock(pjpeg_context_t *pCtx)
+{
+#if PJPG_SIMD
+   idctSimd(pCtx);
+#else
+   idctRows(pCtx);
+   idctCols(pCtx);
+#endif
+}
+/*----------------------------------------------------------------------------*/
+static void transformYCbCr(pjpeg_context_t *pCtx, uint8 mcuBlock, uint8 numY, uint8 yStep)
+{
+   PJPG_STATS_START(t);
+
+   idctBlock(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
+
+   storeYCbCr(pCtx, mcuBlock, 8, numY, yStep);
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+
+static void transformBlockYCbCrH1V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformYCbCr(pCtx, mcuBlock, 1, 0); }
+static void transformBlockYCbCrH2V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformYCbCr(pCtx, mcuBlock, 2, 64); }
+static void transformBlockYCbCrH1V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformYCbCr(pCtx, mcuBlock, 2, 128); }
+static void transformBlockYCbCrH2V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformYCbCr(pCtx, mcuBlock, 4, 64); }
+/*----------------------------------------------------------------------------*/
+static void transformBlockGray(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   PJPG_STATS_START(t);
+
+   idctBlock(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
+
+   // MCU size: 1, 1 block per MCU
+   (void)mcuBlock;
+   copyY(pCtx, 0);
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+/*----------------------------------------------------------------------------*/
+static void transformBlockH1V1(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   PJPG_STATS_START(t);
+
+   idctBlock(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
+
+   // MCU size: 8x8, 3 blocks per MCU
+   switch (mcuBlock)
+   {
+      case 0:
+      {
+         copyY(pCtx, 0);
          break;
       }
-      case PJPG_YH2V2:
+      case 1:
       {
-         // MCU size: 16x16, 6 blocks per MCU
-         switch (mcuBlock)
-         {
-            case 0:
-            {
-               gMCUBufR[0] = c;
-               gMCUBufG[0] = c;
-               gMCUBufB[0] = c;
-               break;
-            }
-            case 1:
-            {
-               gMCUBufR[64] = c;
-               gMCUBufG[64] = c;
-               gMCUBufB[64] = c;
-               break;
-            }
-            case 2:
-            {
-               gMCUBufR[128] = c;
-               gMCUBufG[128] = c;
-               gMCUBufB[128] = c;
-               break;
-            }
-            case 3:
-            {
-               gMCUBufR[192] = c;
-               gMCUBufG[192] = c;
-               gMCUBufB[192] = c;
-               break;
-            }
-            case 4:
-            {
-               cbG = ((c * 88U) >> 8U) - 44U;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], cbG);
-               gMCUBufG[64] = subAndClamp(gMCUBufG[64], cbG);
-               gMCUBufG[128] = subAndClamp(gMCUBufG[128], cbG);
-               gMCUBufG[192] = subAndClamp(gMCUBufG[192], cbG);
-
-               cbB = (c + ((c * 198U) >> 8U)) - 227U;
-               gMCUBufB[0] = addAndClamp(gMCUBufB[0], cbB);
-               gMCUBufB[64] = addAndClamp(gMCUBufB[64], cbB);
-               gMCUBufB[128] = addAndClamp(gMCUBufB[128], cbB);
-               gMCUBufB[192] = addAndClamp(gMCUBufB[192], cbB);
-
-               break;
-            }
-            case 5:
-            {
-               crR = (c + ((c * 103U) >> 8U)) - 179;
-               gMCUBufR[0] = addAndClamp(gMCUBufR[0], crR);
-               gMCUBufR[64] = addAndClamp(gMCUBufR[64], crR);
-               gMCUBufR[128] = addAndClamp(gMCUBufR[128], crR);
-               gMCUBufR[192] = addAndClamp(gMCUBufR[192], crR);
-
-               crG = ((c * 183U) >> 8U) - 91;
-               gMCUBufG[0] = subAndClamp(gMCUBufG[0], crG);
-               gMCUBufG[64] = subAndClamp(gMCUBufG[64], crG);
-               gMCUBufG[128] = subAndClamp(gMCUBufG[128], crG);
-               gMCUBufG[192] = subAndClamp(gMCUBufG[192], crG);
-
-               break;
-            }
-         }
+         convertCb(pCtx, 0);
+         break;
+      }
+      case 2:
+      {
+         convertCr(pCtx, 0);
          break;
       }
    }
+
+   PJPG_STATS_LAP(m_colorTicks, t);
 }
-//------------------------------------------------------------------------------
-static uint8 decodeNextMCU(void)
+/*----------------------------------------------------------------------------*/
+static void transformBlockH1V2(pjpeg_context_t *pCtx, uint8 mcuBlock)
 {
-   uint8 status;
-   uint8 mcuBlock;   
+   PJPG_STATS_START(t);
+
+   idctBlock(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
 
-   if (gRestartInterval) 
+   // MCU size: 8x16, 4 blocks per MCU
+   switch (mcuBlock)
    {
-      if (gRestartsLeft == 0)
+      case 0:
       {
-         status = processRestart();
-         if (status)
-            return status;
+         copyY(pCtx, 0);
+         break;
       }
-      gRestartsLeft--;
-   }      
-   
-   for (mcuBlock = 0; mcuBlock < gMaxBlocksPerMCU; mcuBlock++)
-   {
-      uint8 componentID = gMCUOrg[mcuBlock];
-      uint8 compQuant = gCompQuant[componentID];	
-      uint8 compDCTab = gCompDCTab[componentID];
+      case 1:
+      {
+         copyY(pCtx, 128);
+         break;
+      }
+      case 2:
+      {
+         upsampleCbV(pCtx, 0, 0);
+         upsampleCbV(pCtx, 4*8, 128);
+         break;
+      }
+      case 3:
+      {
+         upsampleCrV(pCtx, 0, 0);
+         upsampleCrV(pCtx, 4*8, 128);
+         break;
+      }
+   }
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+/*----------------------------------------------------------------------------*/
+static void transformBlockH2V1(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   PJPG_STATS_START(t);
+
+   idctBlock(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
+
+   // MCU size: 16x8, 4 blocks per MCU
+   switch (mcuBlock)
+   {
+      case 0:
+      {
+         copyY(pCtx, 0);
+         break;
+      }
+      case 1:
+      {
+         copyY(pCtx, 64);
+         break;
+      }
+      case 2:
+      {
+         upsampleCbH(pCtx, 0, 0);
+         upsampleCbH(pCtx, 4, 64);
+         break;
+      }
+      case 3:
+      {
+         upsampleCrH(pCtx, 0, 0);
+         upsampleCrH(pCtx, 4, 64);
+         break;
+      }
+   }
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+/*----------------------------------------------------------------------------*/
+static void transformBlockH2V2(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   PJPG_STATS_START(t);
+
+   idctBlock(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
+
+   // MCU size: 16x16, 6 blocks per MCU
+   switch (mcuBlock)
+   {
+      case 0:
+      {
+         copyY(pCtx, 0);
+         break;
+      }
+      case 1:
+      {
+         copyY(pCtx, 64);
+         break;
+      }
+      case 2:
+      {
+         copyY(pCtx, 128);
+         break;
+      }
+      case 3:
+      {
+         copyY(pCtx, 192);
+         break;
+      }
+      case 4:
+      {
+         upsampleCb(pCtx, 0, 0);
+         upsampleCb(pCtx, 4, 64);
+         upsampleCb(pCtx, 4*8, 128);
+         upsampleCb(pCtx, 4+4*8, 192);
+         break;
+      }
+      case 5:
+      {
+         upsampleCr(pCtx, 0, 0);
+         upsampleCr(pCtx, 4, 64);
+         upsampleCr(pCtx, 4*8, 128);
+         upsampleCr(pCtx, 4+4*8, 192);
+         break;
+      }
+   }
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+//------------------------------------------------------------------------------
+// Reduced size IDCT's for the 1/2 and 1/4 scaled modes. Only the low frequency
+// 4x4 or 2x2 coefficients are used, evaluated at the centres of each 2x2 or 4x4
+// group of pixels (as libjpeg's reduced IDCT's do). The coefficients are still
+// scaled by the Winograd factors, which are folded into the constants below.
+// The output is left in the top left corner of the coefficient buffer, 8 per row.
+
+// cos(k*pi/8) / cos(u*pi/16) products, * 256
+static PJPG_INLINE int16 imul_r(int16 w, int16 k)
+{
+   long x = (w * (long)k);
+   x += 128L;
+   return (int16)(PJPG_ARITH_SHIFT_RIGHT_8_L(x));
+}
+
+static void idct4x4(pjpeg_context_t *pCtx)
+{
+   uint8 i;
+   int16* pSrc = pCtx->mCoeffBuf;
+
+   for (i = 0; i < 4; i++)
+   {
+      int16 e0 = pSrc[0] + imul_r(pSrc[2], 196);
+      int16 e1 = pSrc[0] - imul_r(pSrc[2], 196);
+      int16 o0 = imul_r(pSrc[1], 241) + imul_r(pSrc[3], 118);
+      int16 o1 = imul_r(pSrc[1], 100) - imul_r(pSrc[3], 284);
+
+      pSrc[0] = e0 + o0;
+      pSrc[1] = e1 + o1;
+      pSrc[2] = e1 - o1;
+      pSrc[3] = e0 - o0;
+
+      pSrc += 8;
+   }
+
+   pSrc = pCtx->mCoeffBuf;
+
+   for (i = 0; i < 4; i++)
+   {
+      int16 e0 = pSrc[0*8] + imul_r(pSrc[2*8], 196);
+      int16 e1 = pSrc[0*8] - imul_r(pSrc[2*8], 196);
+      int16 o0 = imul_r(pSrc[1*8], 241) + imul_r(pSrc[3*8], 118);
+      int16 o1 = imul_r(pSrc[1*8], 100) - imul_r(pSrc[3*8], 284);
+
+      pSrc[0*8] = clamp(PJPG_DESCALE(e0 + o0) + 128);
+      pSrc[1*8] = clamp(PJPG_DESCALE(e1 + o1) + 128);
+      pSrc[2*8] = clamp(PJPG_DESCALE(e1 - o1) + 128);
+      pSrc[3*8] = clamp(PJPG_DESCALE(e0 - o0) + 128);
+
+      pSrc++;
+   }
+}
+
+static void idct2x2(pjpeg_context_t *pCtx)
+{
+   int16* pSrc = pCtx->mCoeffBuf;
+
+   int16 r0 = imul_r(pSrc[1], 185);
+   int16 r1 = imul_r(pSrc[9], 185);
+   int16 x00 = pSrc[0] + r0;
+   int16 x01 = pSrc[0] - r0;
+   int16 x10 = pSrc[8] + r1;
+   int16 x11 = pSrc[8] - r1;
+
+   x10 = imul_r(x10, 185);
+   x11 = imul_r(x11, 185);
+
+   pSrc[0] = clamp(PJPG_DESCALE(x00 + x10) + 128);
+   pSrc[1] = clamp(PJPG_DESCALE(x01 + x11) + 128);
+   pSrc[8] = clamp(PJPG_DESCALE(x00 - x10) + 128);
+   pSrc[9] = clamp(PJPG_DESCALE(x01 - x11) + 128);
+}
+//------------------------------------------------------------------------------
+// Spreads an n x n Cb or Cr block over the MCU's n x n Y blocks, which are at
+// byte offsets 0, 64, 128, 192 as in full size mode. hShift and vShift are 1 where
+// the chroma is subsampled.
+static void upsampleScaled(pjpeg_context_t *pCtx, uint8 n, uint8 isCr, uint8 hShift, uint8 vShift)
+{
+   uint8 bx, by, x, y;
+
+   for (by = 0; by <= vShift; by++)
+   {
+      for (bx = 0; bx <= hShift; bx++)
+      {
+         uint8 dstOfs = (uint8)(by * 128 + bx * 64);
+
+         for (y = 0; y < n; y++)
+         {
+            const int16* pSrc = pCtx->mCoeffBuf + ((by * n + y) >> vShift) * 8;
+            uint8* pDstR = pCtx->mMCUBufR + dstOfs + y * 8;
+            uint8* pDstG = pCtx->mMCUBufG + dstOfs + y * 8;
+            uint8* pDstB = pCtx->mMCUBufB + dstOfs + y * 8;
+
+            for (x = 0; x < n; x++)
+            {
+               uint8 c = (uint8)pSrc[(bx * n + x) >> hShift];
+
+               if (isCr)
+               {
+                  int16 crR = (c + ((c * 103U) >> 8U)) - 179;
+                  int16 crG = ((c * 183U) >> 8U) - 91;
+                  pDstR[x] = addAndClamp(pDstR[x], crR);
+                  pDstG[x] = subAndClamp(pDstG[x], crG);
+               }
+               else
+               {
+                  int16 cbG = ((c * 88U) >> 8U) - 44U;
+                  int16 cbB = (c + ((c * 198U) >> 8U)) - 227U;
+                  pDstG[x] = subAndClamp(pDstG[x], cbG);
+                  pDstB[x] = addAndClamp(pDstB[x], cbB);
+               }
+            }
+         }
+      }
+   }
+}
+//------------------------------------------------------------------------------
+// 1/2 and 1/4 scaled modes, each block is decoded to n x n pixels which are
+// stored in the top left corner of the block's usual 8x8 area.
+static uint8 idctScaled(pjpeg_context_t *pCtx)
+{
+   if (pCtx->mReduce == PJPG_REDUCE_1_2)
+   {
+      idct4x4(pCtx);
+      return 4;
+   }
+
+   idct2x2(pCtx);
+   return 2;
+}
+/*----------------------------------------------------------------------------*/
+static void transformScaledYCbCr(pjpeg_context_t *pCtx, uint8 mcuBlock, uint8 numY, uint8 yStep)
+{
+   uint8 n;
+   PJPG_STATS_START(t);
+
+   n = idctScaled(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
+
+   storeYCbCr(pCtx, mcuBlock, n, numY, yStep);
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+
+static void transformBlockScaledYCbCrH1V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaledYCbCr(pCtx, mcuBlock, 1, 0); }
+static void transformBlockScaledYCbCrH2V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaledYCbCr(pCtx, mcuBlock, 2, 64); }
+static void transformBlockScaledYCbCrH1V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaledYCbCr(pCtx, mcuBlock, 2, 128); }
+static void transformBlockScaledYCbCrH2V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaledYCbCr(pCtx, mcuBlock, 4, 64); }
+/*----------------------------------------------------------------------------*/
+// The MCU's numY Y blocks are yStep bytes apart in the MCU buffers, Cb and Cr follow.
+static void transformScaled(pjpeg_context_t *pCtx, uint8 mcuBlock, uint8 numY, uint8 yStep, uint8 hShift, uint8 vShift)
+{
+   uint8 x, y, n;
+   PJPG_STATS_START(t);
+
+   n = idctScaled(pCtx);
+   PJPG_STATS_LAP(m_idctTicks, t);
+
+   if (mcuBlock < numY)
+   {
+      uint8 dstOfs = (uint8)(mcuBlock * yStep);
+
+      for (y = 0; y < n; y++)
+      {
+         for (x = 0; x < n; x++)
+         {
+            uint8 c = (uint8)pCtx->mCoeffBuf[y * 8 + x];
+            uint8 ofs = (uint8)(dstOfs + y * 8 + x);
+
+            pCtx->mMCUBufR[ofs] = c;
+            pCtx->mMCUBufG[ofs] = c;
+            pCtx->mMCUBufB[ofs] = c;
+         }
+      }
+   }
+   else
+      upsampleScaled(pCtx, n, (uint8)(mcuBlock > numY), hShift, vShift);
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+
+static void transformBlockScaledH1V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaled(pCtx, mcuBlock, 1, 0, 0, 0); }
+static void transformBlockScaledH2V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaled(pCtx, mcuBlock, 2, 64, 1, 0); }
+static void transformBlockScaledH1V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaled(pCtx, mcuBlock, 2, 128, 0, 1); }
+static void transformBlockScaledH2V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformScaled(pCtx, mcuBlock, 4, 64, 1, 1); }
+//------------------------------------------------------------------------------
+// PJPG_REDUCE_1_8, each block is decoded to its DC pixel. The Y pixel at ofs is
+// set to c in all three of the MCU buffers and the chroma pixels are applied to the
+// n Y pixels step bytes apart from 0.
+static PJPG_INLINE uint8 reduceDC(const pjpeg_context_t *pCtx)
+{
+   return clamp(PJPG_DESCALE(pCtx->mCoeffBuf[0]) + 128);
+}
+
+static void reduceY(pjpeg_context_t *pCtx, uint8 ofs, uint8 c)
+{
+   pCtx->mMCUBufR[ofs] = c;
+   pCtx->mMCUBufG[ofs] = c;
+   pCtx->mMCUBufB[ofs] = c;
+}
+
+static void reduceCb(pjpeg_context_t *pCtx, uint8 c, uint8 n, uint8 step)
+{
+   int16 cbG = ((c * 88U) >> 8U) - 44U;
+   int16 cbB = (c + ((c * 198U) >> 8U)) - 227U;
+   uint8 ofs = 0;
+
+   for ( ; n; n--, ofs = (uint8)(ofs + step))
+   {
+      pCtx->mMCUBufG[ofs] = subAndClamp(pCtx->mMCUBufG[ofs], cbG);
+      pCtx->mMCUBufB[ofs] = addAndClamp(pCtx->mMCUBufB[ofs], cbB);
+   }
+}
+
+static void reduceCr(pjpeg_context_t *pCtx, uint8 c, uint8 n, uint8 step)
+{
+   int16 crR = (c + ((c * 103U) >> 8U)) - 179;
+   int16 crG = ((c * 183U) >> 8U) - 91;
+   uint8 ofs = 0;
+
+   for ( ; n; n--, ofs = (uint8)(ofs + step))
+   {
+      pCtx->mMCUBufR[ofs] = addAndClamp(pCtx->mMCUBufR[ofs], crR);
+      pCtx->mMCUBufG[ofs] = subAndClamp(pCtx->mMCUBufG[ofs], crG);
+   }
+}
+/*----------------------------------------------------------------------------*/
+static void transformReduceYCbCr(pjpeg_context_t *pCtx, uint8 mcuBlock, uint8 numY, uint8 yStep)
+{
+   PJPG_STATS_START(t);
+
+   pCtx->mCoeffBuf[0] = reduceDC(pCtx);
+   storeYCbCr(pCtx, mcuBlock, 1, numY, yStep);
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+
+static void transformBlockReduceYCbCrH1V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformReduceYCbCr(pCtx, mcuBlock, 1, 0); }
+static void transformBlockReduceYCbCrH2V1(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformReduceYCbCr(pCtx, mcuBlock, 2, 64); }
+static void transformBlockReduceYCbCrH1V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformReduceYCbCr(pCtx, mcuBlock, 2, 128); }
+static void transformBlockReduceYCbCrH2V2(pjpeg_context_t *pCtx, uint8 mcuBlock) { transformReduceYCbCr(pCtx, mcuBlock, 4, 64); }
+/*----------------------------------------------------------------------------*/
+static void transformBlockReduceGray(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   PJPG_STATS_START(t);
+
+   // MCU size: 1, 1 block per MCU
+   (void)mcuBlock;
+   pCtx->mMCUBufR[0] = reduceDC(pCtx);
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+/*----------------------------------------------------------------------------*/
+static void transformBlockReduceH1V1(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   uint8 c = reduceDC(pCtx);
+   PJPG_STATS_START(t);
+
+   // MCU size: 8x8, 3 blocks per MCU
+   if (mcuBlock == 0)
+      reduceY(pCtx, 0, c);
+   else if (mcuBlock == 1)
+      reduceCb(pCtx, c, 1, 0);
+   else
+      reduceCr(pCtx, c, 1, 0);
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+/*----------------------------------------------------------------------------*/
+static void transformBlockReduceH1V2(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   uint8 c = reduceDC(pCtx);
+   PJPG_STATS_START(t);
+
+   // MCU size: 8x16, 4 blocks per MCU
+   if (mcuBlock < 2)
+      reduceY(pCtx, (uint8)(mcuBlock * 128), c);
+   else if (mcuBlock == 2)
+      reduceCb(pCtx, c, 2, 128);
+   else
+      reduceCr(pCtx, c, 2, 128);
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+/*----------------------------------------------------------------------------*/
+static void transformBlockReduceH2V1(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   uint8 c = reduceDC(pCtx);
+   PJPG_STATS_START(t);
+
+   // MCU size: 16x8, 4 blocks per MCU
+   if (mcuBlock < 2)
+      reduceY(pCtx, (uint8)(mcuBlock * 64), c);
+   else if (mcuBlock == 2)
+      reduceCb(pCtx, c, 2, 64);
+   else
+      reduceCr(pCtx, c, 2, 64);
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+/*----------------------------------------------------------------------------*/
+static void transformBlockReduceH2V2(pjpeg_context_t *pCtx, uint8 mcuBlock)
+{
+   uint8 c = reduceDC(pCtx);
+   PJPG_STATS_START(t);
+
+   // MCU size: 16x16, 6 blocks per MCU
+   if (mcuBlock < 4)
+      reduceY(pCtx, (uint8)(mcuBlock * 64), c);
+   else if (mcuBlock == 4)
+      reduceCb(pCtx, c, 4, 64);
+   else
+      reduceCr(pCtx, c, 4, 64);
+
+   PJPG_STATS_LAP(m_colorTicks, t);
+}
+//------------------------------------------------------------------------------
+// Chooses the block transform for the image's output, reduce mode and scan type.
+// Greyscale images only have block 0, which the H1V1 YCbCr and scaled transforms
+// store the same way.
+static void selectTransform(pjpeg_context_t *pCtx)
+{
+   static const pjpeg_transform_block_t transforms[2][4][5] =
+   {
+      {  // PJPG_OUTPUT_RGB
+         { transformBlockGray, transformBlockH1V1, transformBlockH2V1, transformBlockH1V2, transformBlockH2V2 },
+         { transformBlockReduceGray, transformBlockReduceH1V1, transformBlockReduceH2V1, transformBlockReduceH1V2, transformBlockReduceH2V2 },
+         { transformBlockScaledH1V1, transformBlockScaledH1V1, transformBlockScaledH2V1, transformBlockScaledH1V2, transformBlockScaledH2V2 },
+         { transformBlockScaledH1V1, transformBlockScaledH1V1, transformBlockScaledH2V1, transformBlockScaledH1V2, transformBlockScaledH2V2 }
+      },
+      {  // PJPG_OUTPUT_YCBCR
+         { transformBlockYCbCrH1V1, transformBlockYCbCrH1V1, transformBlockYCbCrH2V1, transformBlockYCbCrH1V2, transformBlockYCbCrH2V2 },
+         { transformBlockReduceYCbCrH1V1, transformBlockReduceYCbCrH1V1, transformBlockReduceYCbCrH2V1, transformBlockReduceYCbCrH1V2, transformBlockReduceYCbCrH2V2 },
+         { transformBlockScaledYCbCrH1V1, transformBlockScaledYCbCrH1V1, transformBlockScaledYCbCrH2V1, transformBlockScaledYCbCrH1V2, transformBlockScaledYCbCrH2V2 },
+         { transformBlockScaledYCbCrH1V1, transformBlockScaledYCbCrH1V1, transformBlockScaledYCbCrH2V1, transformBlockScaledYCbCrH1V2, transformBlockScaledYCbCrH2V2 }
+      }
+   };
+   // Any other output is RGB, and any other reduce mode 2x2 blocks as idctScaled() makes
+   uint8 output = (uint8)(pCtx->mOutput == PJPG_OUTPUT_YCBCR);
+   uint8 reduce = (pCtx->mReduce > PJPG_REDUCE_1_2) ? (uint8)PJPG_REDUCE_1_4 : pCtx->mReduce;
+
+   pCtx->mpTransformBlock = transforms[output][reduce][pCtx->mScanType];
+}
+//------------------------------------------------------------------------------
+// If skip is set the MCU is only entropy decoded, as for pjpeg_skip_mcu_ctx().
+static uint8 decodeNextMCU(pjpeg_context_t *pCtx, uint8 skip)
+{
+   uint8 status;
+   uint8 mcuBlock;   
+   // Decode, but throw out the AC coefficients in reduce mode.
+   uint8 dcOnly = (uint8)((skip) || (pCtx->mReduce == PJPG_REDUCE_1_8));
+
+   if (pCtx->mRestartInterval) 
+   {
+      if (pCtx->mRestartsLeft == 0)
+      {
+         status = processRestart(pCtx);
+         if (status)
+            return status;
+      }
+      pCtx->mRestartsLeft--;
+   }      
+   
+   for (mcuBlock = 0; mcuBlock < pCtx->mMaxBlocksPerMCU; mcuBlock++)
+   {
+      uint8 componentID = pCtx->mMCUOrg[mcuBlock];
+      uint8 compQuant = pCtx->mCompQuant[componentID];	
+      uint8 compDCTab = pCtx->mCompDCTab[componentID];
       uint8 numExtraBits, compACTab, k;
-      const int16* pQ = compQuant ? gQuant1 : gQuant0;
+      const int16* pQ = compQuant ? pCtx->mQuant1 : pCtx->mQuant0;
       uint16 r, dc;
+#if PJPG_FAST_AC
+      const FastACTable* pFastAC;
+#endif
+
+      uint8 s = huffDecode(pCtx, compDCTab ? &pCtx->mHuffTab1 : &pCtx->mHuffTab0, compDCTab ? pCtx->mHuffVal1 : pCtx->mHuffVal0);
 
-      uint8 s = huffDecode(compDCTab ? &gHuffTab1 : &gHuffTab0, compDCTab ? gHuffVal1 : gHuffVal0);
+      if (!skip)
+         PJPG_STATS_INC(m_blocks);
       
       r = 0;
       numExtraBits = s & 0xF;
       if (numExtraBits)
-         r = getBits2(numExtraBits);
+         r = getBits2(pCtx, numExtraBits);
       dc = huffExtend(r, s);
             
-      dc = dc + gLastDC[componentID];
-      gLastDC[componentID] = dc;
+      dc = dc + pCtx->mLastDC[componentID];
+      pCtx->mLastDC[componentID] = dc;
             
-      gCoeffBuf[0] = dc * pQ[0];
+      pCtx->mCoeffBuf[0] = dc * pQ[0];
 
-      compACTab = gCompACTab[componentID];
+      compACTab = pCtx->mCompACTab[componentID];
+#if PJPG_FAST_AC
+      pFastAC = compACTab ? &pCtx->mFastAC3 : &pCtx->mFastAC2;
+#endif
 
-      if (gReduce)
+      if (dcOnly)
       {
-         // Decode, but throw out the AC coefficients in reduce mode.
          for (k = 1; k < 64; k++)
          {
-            s = huffDecode(compACTab ? &gHuffTab3 : &gHuffTab2, compACTab ? gHuffVal3 : gHuffVal2);
+#if PJPG_FAST_AC
+            uint8 look = peekBits8(pCtx);
+            uint8 runLen = pFastAC->mRunLen[look];
+
+            if (runLen)
+            {
+               getBits2(pCtx, runLen & 15);
+
+               r = runLen >> 4;
+               if ((k + r) > 63)
+                  return PJPG_DECODE_ERROR;
+
+               k = (uint8)(k + r);
+               continue;
+            }
+#endif
+            s = huffDecode(pCtx, compACTab ? &pCtx->mHuffTab3 : &pCtx->mHuffTab2, compACTab ? pCtx->mHuffVal3 : pCtx->mHuffVal2);
 
             numExtraBits = s & 0xF;
             if (numExtraBits)
-               getBits2(numExtraBits);
+               getBits2(pCtx, numExtraBits);
 
             r = s >> 4;
             s &= 15;
@@ -2201,7 +3216,8 @@ static uint8 decodeNextMCU(void)
             }
          }
 
-         transformBlockReduce(mcuBlock); 
+         if (!skip)
+            pCtx->mpTransformBlock(pCtx, mcuBlock);
       }
       else
       {
@@ -2209,13 +3225,36 @@ static uint8 decodeNextMCU(void)
          for (k = 1; k < 64; k++)
          {
             uint16 extraBits;
+#if PJPG_FAST_AC
+            uint8 look = peekBits8(pCtx);
+            uint8 runLen = pFastAC->mRunLen[look];
+
+            if (runLen)
+            {
+               // Code, zero run and coefficient all come from the one lookup.
+               getBits2(pCtx, runLen & 15);
+
+               r = runLen >> 4;
+               if ((k + r) > 63)
+                  return PJPG_DECODE_ERROR;
 
-            s = huffDecode(compACTab ? &gHuffTab3 : &gHuffTab2, compACTab ? gHuffVal3 : gHuffVal2);
+               while (r)
+               {
+                  pCtx->mCoeffBuf[ZAG[k++]] = 0;
+                  r--;
+               }
+
+               pCtx->mCoeffBuf[ZAG[k]] = pFastAC->mVal[look] * pQ[k];
+               continue;
+            }
+#endif
+
+            s = huffDecode(pCtx, compACTab ? &pCtx->mHuffTab3 : &pCtx->mHuffTab2, compACTab ? pCtx->mHuffVal3 : pCtx->mHuffVal2);
 
             extraBits = 0;
             numExtraBits = s & 0xF;
             if (numExtraBits)
-               extraBits = getBits2(numExtraBits);
+               extraBits = getBits2(pCtx, numExtraBits);
 
             r = s >> 4;
             s &= 15;
@@ -2231,14 +3270,14 @@ static uint8 decodeNextMCU(void)
 
                   while (r)
                   {
-                     gCoeffBuf[ZAG[k++]] = 0;
+                     pCtx->mCoeffBuf[ZAG[k++]] = 0;
                      r--;
                   }
                }
 
                ac = huffExtend(extraBits, s);
                
-               gCoeffBuf[ZAG[k]] = ac * pQ[k]; 
+               pCtx->mCoeffBuf[ZAG[k]] = ac * pQ[k]; 
             }
             else
             {
@@ -2248,7 +3287,7 @@ static uint8 decodeNextMCU(void)
                      return PJPG_DECODE_ERROR;
                   
                   for (r = 16; r > 0; r--)
-                     gCoeffBuf[ZAG[k++]] = 0;
+                     pCtx->mCoeffBuf[ZAG[k++]] = 0;
                   
                   k--; // - 1 because the loop counter is k
                }
@@ -2258,76 +3297,954 @@ static uint8 decodeNextMCU(void)
          }
          
          while (k < 64)
-            gCoeffBuf[ZAG[k++]] = 0;
+            pCtx->mCoeffBuf[ZAG[k++]] = 0;
 
-         transformBlock(mcuBlock); 
+         pCtx->mpTransformBlock(pCtx, mcuBlock);
       }
    }
          
    return 0;
 }
+#if PJPG_PROGRESSIVE
 //------------------------------------------------------------------------------
-unsigned char pjpeg_decode_mcu(void)
+// Progressive JPEG support. Each scan adds a band of coefficients (or another bit
+// of them) to every block of one or more components, so the whole image's
+// coefficients are kept in the caller's buffer until the last scan has been read.
+// Once they are, outputProgressiveMCU() dequantizes and transforms them an MCU at a
+// time, much as decodeNextMCU() does for baseline images.
+
+// Lays out the coefficient buffer and returns its size in bytes.
+static unsigned long initCoeffBuf(pjpeg_context_t *pCtx)
 {
-   uint8 status;
-   
-   if (gCallbackStatus)
-      return gCallbackStatus;
-   
-   if ((!gNumMCUSRemainingX) && (!gNumMCUSRemainingY))
-      return PJPG_NO_MORE_BLOCKS;
-         
-   status = decodeNextMCU();
-   if ((status) || (gCallbackStatus))
-      return gCallbackStatus ? gCallbackStatus : status;
-      
-   gNumMCUSRemainingX--;
-   if (!gNumMCUSRemainingX)
+   uint8 c;
+   unsigned long blocks = 0;
+
+   for (c = 0; c < pCtx->mCompsInFrame; c++)
    {
-      gNumMCUSRemainingY--;
-	  if (gNumMCUSRemainingY > 0)
-		  gNumMCUSRemainingX = gMaxMCUSPerRow;
+      pCtx->mCompCoeffOfs[c] = blocks;
+      blocks += (unsigned long)(pCtx->mMaxMCUSPerRow * pCtx->mCompHSamp[c]) * (pCtx->mMaxMCUSPerCol * pCtx->mCompVSamp[c]);
    }
-   
-   return 0;
+
+   return blocks * 64 * sizeof(short);
 }
 //------------------------------------------------------------------------------
-unsigned char pjpeg_decode_init(pjpeg_image_info_t *pInfo, pjpeg_need_bytes_callback_t pNeed_bytes_callback, void *pCallback_data, unsigned char reduce)
+static PJPG_INLINE int16* getCoeffBlock(pjpeg_context_t *pCtx, uint8 c, uint16 bx, uint16 by)
 {
-   uint8 status;
-   
-   pInfo->m_width = 0; pInfo->m_height = 0; pInfo->m_comps = 0;
-   pInfo->m_MCUSPerRow = 0; pInfo->m_MCUSPerCol = 0;
-   pInfo->m_scanType = PJPG_GRAYSCALE;
-   pInfo->m_MCUWidth = 0; pInfo->m_MCUHeight = 0;
-   pInfo->m_pMCUBufR = (unsigned char*)0; pInfo->m_pMCUBufG = (unsigned char*)0; pInfo->m_pMCUBufB = (unsigned char*)0;
+   unsigned long blocksPerRow = pCtx->mMaxMCUSPerRow * pCtx->mCompHSamp[c];
 
-   g_pNeedBytesCallback = pNeed_bytes_callback;
-   g_pCallback_data = pCallback_data;
-   gCallbackStatus = 0;
-   gReduce = reduce;
-    
-   status = init();
-   if ((status) || (gCallbackStatus))
-      return gCallbackStatus ? gCallbackStatus : status;
-   
-   status = locateSOFMarker();
-   if ((status) || (gCallbackStatus))
-      return gCallbackStatus ? gCallbackStatus : status;
-
-   status = initFrame();
-   if ((status) || (gCallbackStatus))
-      return gCallbackStatus ? gCallbackStatus : status;
-
-   status = initScan();
-   if ((status) || (gCallbackStatus))
-      return gCallbackStatus ? gCallbackStatus : status;
-
-   pInfo->m_width = gImageXSize; pInfo->m_height = gImageYSize; pInfo->m_comps = gCompsInFrame;
-   pInfo->m_scanType = gScanType;
-   pInfo->m_MCUSPerRow = gMaxMCUSPerRow; pInfo->m_MCUSPerCol = gMaxMCUSPerCol;
-   pInfo->m_MCUWidth = gMaxMCUXSize; pInfo->m_MCUHeight = gMaxMCUYSize;
-   pInfo->m_pMCUBufR = gMCUBufR; pInfo->m_pMCUBufG = gMCUBufG; pInfo->m_pMCUBufB = gMCUBufB;
-      
-   return 0;
+   return pCtx->mpCoeffs + (pCtx->mCompCoeffOfs[c] + by * blocksPerRow + bx) * 64;
+}
+//------------------------------------------------------------------------------
+// Reads the next SOS marker (and any tables before it), sets *pFoundEOI at the end of the image.
+static uint8 initProgressiveScan(pjpeg_context_t *pCtx, uint8* pFoundEOI)
+{
+   uint8 i;
+   uint8 status = locateSOSMarker(pCtx, pFoundEOI);
+   if ((status) || (*pFoundEOI))
+      return status;
+
+   if (pCtx->mSpectralStart == 0)
+   {
+      // DC scans may be interleaved, only the first pass of each is Huffman coded
+      if (pCtx->mSpectralEnd != 0)
+         return PJPG_BAD_SOS_SPECTRAL;
+
+      if (pCtx->mSuccessiveHigh == 0)
+      {
+         for (i = 0; i < pCtx->mCompsInScan; i++)
+            if (checkHuffTable(pCtx, 0, pCtx->mCompDCTab[pCtx->mCompList[i]]))
+               return PJPG_UNDEFINED_HUFF_TABLE;
+      }
+   }
+   else
+   {
+      // AC scans are always of a single component
+      if ((pCtx->mSpectralEnd < pCtx->mSpectralStart) || (pCtx->mSpectralEnd > 63) || (pCtx->mCompsInScan != 1))
+         return PJPG_BAD_SOS_SPECTRAL;
+
+      if (checkHuffTable(pCtx, 1, pCtx->mCompACTab[pCtx->mCompList[0]]))
+         return PJPG_UNDEFINED_HUFF_TABLE;
+   }
+
+   if ((pCtx->mSuccessiveLow > 13) || ((pCtx->mSuccessiveHigh) && (pCtx->mSuccessiveHigh != pCtx->mSuccessiveLow + 1)))
+      return PJPG_BAD_SOS_SUCCESSIVE;
+
+   pCtx->mLastDC[0] = 0;
+   pCtx->mLastDC[1] = 0;
+   pCtx->mLastDC[2] = 0;
+
+   pCtx->mEOBRun = 0;
+
+   if (pCtx->mRestartInterval)
+   {
+      pCtx->mRestartsLeft = pCtx->mRestartInterval;
+      pCtx->mNextRestartNum = 0;
+   }
+
+   fixInBuffer(pCtx);
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+static void decodeBlockDCFirst(pjpeg_context_t *pCtx, uint8 c, int16* pBlock)
+{
+   uint8 compDCTab = pCtx->mCompDCTab[c];
+   uint8 s = huffDecode(pCtx, compDCTab ? &pCtx->mHuffTab1 : &pCtx->mHuffTab0, compDCTab ? pCtx->mHuffVal1 : pCtx->mHuffVal0);
+   uint16 r = 0, dc;
+
+   s &= 0xF;
+   if (s)
+      r = getBits2(pCtx, s);
+   dc = huffExtend(r, s);
+
+   dc = dc + pCtx->mLastDC[c];
+   pCtx->mLastDC[c] = dc;
+
+   pBlock[0] = (int16)(dc << pCtx->mSuccessiveLow);
+}
+//------------------------------------------------------------------------------
+static void decodeBlockDCRefine(pjpeg_context_t *pCtx, int16* pBlock)
+{
+   if (getBit(pCtx))
+      pBlock[0] |= (int16)(1 << pCtx->mSuccessiveLow);
+}
+//------------------------------------------------------------------------------
+static uint8 decodeBlockACFirst(pjpeg_context_t *pCtx, uint8 c, int16* pBlock)
+{
+   uint8 compACTab = pCtx->mCompACTab[c];
+   uint8 k, r, s;
+
+   if (pCtx->mEOBRun)
+   {
+      pCtx->mEOBRun--;
+      return 0;
+   }
+
+   for (k = pCtx->mSpectralStart; k <= pCtx->mSpectralEnd; k++)
+   {
+      s = huffDecode(pCtx, compACTab ? &pCtx->mHuffTab3 : &pCtx->mHuffTab2, compACTab ? pCtx->mHuffVal3 : pCtx->mHuffVal2);
+
+      r = s >> 4;
+      s &= 15;
+
+      if (s)
+      {
+         k = (uint8)(k + r);
+         if (k > 63)
+            return PJPG_DECODE_ERROR;
+
+         pBlock[k] = (int16)(huffExtend(getBits2(pCtx, s), s) * (1 << pCtx->mSuccessiveLow));
+      }
+      else if (r == 15)
+      {
+         k = (uint8)(k + 15);
+         if (k > 63)
+            return PJPG_DECODE_ERROR;
+      }
+      else
+      {
+         // End of band for this block and the next mEOBRun blocks
+         pCtx->mEOBRun = (uint16)(1 << r);
+         if (r)
+            pCtx->mEOBRun = (uint16)(pCtx->mEOBRun + getBits2(pCtx, r));
+         pCtx->mEOBRun--;
+         break;
+      }
+   }
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+// Adds the next bit to a coefficient that is already non-zero.
+static PJPG_INLINE void refineCoeff(pjpeg_context_t *pCtx, int16* pCoeff, int16 p1)
+{
+   if ((getBit(pCtx)) && ((*pCoeff & p1) == 0))
+   {
+      if (*pCoeff >= 0)
+         *pCoeff = (int16)(*pCoeff + p1);
+      else
+         *pCoeff = (int16)(*pCoeff - p1);
+   }
+}
+//------------------------------------------------------------------------------
+static uint8 decodeBlockACRefine(pjpeg_context_t *pCtx, uint8 c, int16* pBlock)
+{
+   uint8 compACTab = pCtx->mCompACTab[c];
+   int16 p1 = (int16)(1 << pCtx->mSuccessiveLow);
+   uint8 k = pCtx->mSpectralStart;
+
+   if (!pCtx->mEOBRun)
+   {
+      for ( ; k <= pCtx->mSpectralEnd; k++)
+      {
+         uint8 s = huffDecode(pCtx, compACTab ? &pCtx->mHuffTab3 : &pCtx->mHuffTab2, compACTab ? pCtx->mHuffVal3 : pCtx->mHuffVal2);
+         int8 r = (int8)(s >> 4);
+         int16 newCoeff = 0;
+
+         s &= 15;
+
+         if (s)
+         {
+            // A new coefficient of +/-1 at this bit position
+            if (s != 1)
+               return PJPG_DECODE_ERROR;
+
+            newCoeff = getBit(pCtx) ? p1 : (int16)-p1;
+         }
+         else if (r != 15)
+         {
+            pCtx->mEOBRun = (uint16)(1 << r);
+            if (r)
+               pCtx->mEOBRun = (uint16)(pCtx->mEOBRun + getBits2(pCtx, r));
+            break;
+         }
+
+         // Skip r zero coefficients, refining the non-zero ones passed on the way
+         for ( ; k <= pCtx->mSpectralEnd; k++)
+         {
+            int16* pCoeff = pBlock + k;
+
+            if (*pCoeff)
+               refineCoeff(pCtx, pCoeff, p1);
+            else
+            {
+               if (--r < 0)
+                  break;
+            }
+         }
+
+         if ((newCoeff) && (k < 64))
+            pBlock[k] = newCoeff;
+      }
+   }
+
+   if (pCtx->mEOBRun)
+   {
+      // The rest of the band has no new coefficients, but still refine the old ones
+      for ( ; k <= pCtx->mSpectralEnd; k++)
+      {
+         if (pBlock[k])
+            refineCoeff(pCtx, pBlock + k, p1);
+      }
+
+      pCtx->mEOBRun--;
+   }
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+static uint8 decodeBlockProgressive(pjpeg_context_t *pCtx, uint8 c, uint16 bx, uint16 by)
+{
+   int16* pBlock = getCoeffBlock(pCtx, c, bx, by);
+
+   if (pCtx->mSpectralStart == 0)
+   {
+      if (pCtx->mSuccessiveHigh == 0)
+         decodeBlockDCFirst(pCtx, c, pBlock);
+      else
+         decodeBlockDCRefine(pCtx, pBlock);
+
+      return 0;
+   }
+
+   if (pCtx->mSuccessiveHigh == 0)
+      return decodeBlockACFirst(pCtx, c, pBlock);
+
+   return decodeBlockACRefine(pCtx, c, pBlock);
+}
+//------------------------------------------------------------------------------
+static uint8 decodeProgressiveScan(pjpeg_context_t *pCtx)
+{
+   uint8 status;
+   uint16 x, y;
+
+   if (pCtx->mCompsInScan == 1)
+   {
+      // Non interleaved, the scan covers just the component's own blocks (no MCU
+      // padding) and every block is an MCU as far as restart intervals go.
+      uint8 c = pCtx->mCompList[0];
+      uint8 maxH = pCtx->mMaxMCUXSize >> 3;
+      uint8 maxV = pCtx->mMaxMCUYSize >> 3;
+      uint16 blocksX = (uint16)((((unsigned long)pCtx->mImageXSize * pCtx->mCompHSamp[c] + maxH - 1) / maxH + 7) >> 3);
+      uint16 blocksY = (uint16)((((unsigned long)pCtx->mImageYSize * pCtx->mCompVSamp[c] + maxV - 1) / maxV + 7) >> 3);
+
+      for (y = 0; y < blocksY; y++)
+      {
+         for (x = 0; x < blocksX; x++)
+         {
+            if (pCtx->mRestartInterval)
+            {
+               if (pCtx->mRestartsLeft == 0)
+               {
+                  status = processRestart(pCtx);
+                  if (status)
+                     return status;
+               }
+               pCtx->mRestartsLeft--;
+            }
+
+            status = decodeBlockProgressive(pCtx, c, x, y);
+            if ((status) || (pCtx->mCallbackStatus))
+               return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+         }
+      }
+
+      return 0;
+   }
+
+   for (y = 0; y < pCtx->mMaxMCUSPerCol; y++)
+   {
+      for (x = 0; x < pCtx->mMaxMCUSPerRow; x++)
+      {
+         uint8 i, h, v;
+
+         if (pCtx->mRestartInterval)
+         {
+            if (pCtx->mRestartsLeft == 0)
+            {
+               status = processRestart(pCtx);
+               if (status)
+                  return status;
+            }
+            pCtx->mRestartsLeft--;
+         }
+
+         for (i = 0; i < pCtx->mCompsInScan; i++)
+         {
+            uint8 c = pCtx->mCompList[i];
+
+            for (v = 0; v < pCtx->mCompVSamp[c]; v++)
+            {
+               for (h = 0; h < pCtx->mCompHSamp[c]; h++)
+               {
+                  status = decodeBlockProgressive(pCtx, c, (uint16)(x * pCtx->mCompHSamp[c] + h), (uint16)(y * pCtx->mCompVSamp[c] + v));
+                  if ((status) || (pCtx->mCallbackStatus))
+                     return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+               }
+            }
+         }
+      }
+   }
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+// Dequantizes and transforms the next MCU's blocks from the coefficient buffer.
+static uint8 outputProgressiveMCU(pjpeg_context_t *pCtx)
+{
+   uint16 mcuX = pCtx->mMaxMCUSPerRow - pCtx->mNumMCUSRemainingX;
+   uint16 mcuY = pCtx->mMaxMCUSPerCol - pCtx->mNumMCUSRemainingY;
+   uint8 mcuBlock, compBlock = 0;
+
+   for (mcuBlock = 0; mcuBlock < pCtx->mMaxBlocksPerMCU; mcuBlock++)
+   {
+      uint8 c = pCtx->mMCUOrg[mcuBlock];
+      uint8 h = pCtx->mCompHSamp[c];
+      const int16* pQ = pCtx->mCompQuant[c] ? pCtx->mQuant1 : pCtx->mQuant0;
+      const int16* pBlock;
+      uint8 k;
+
+      // Blocks of a component are in raster order within the MCU
+      if ((mcuBlock) && (c != pCtx->mMCUOrg[mcuBlock - 1]))
+         compBlock = 0;
+
+      pBlock = getCoeffBlock(pCtx, c, (uint16)(mcuX * h + (compBlock % h)), (uint16)(mcuY * pCtx->mCompVSamp[c] + (compBlock / h)));
+      compBlock++;
+
+      PJPG_STATS_INC(m_blocks);
+
+      if (pCtx->mReduce == PJPG_REDUCE_1_8)
+      {
+         pCtx->mCoeffBuf[0] = pBlock[0] * pQ[0];
+         pCtx->mpTransformBlock(pCtx, mcuBlock);
+         continue;
+      }
+
+      for (k = 0; k < 64; k++)
+         pCtx->mCoeffBuf[ZAG[k]] = pBlock[k] * pQ[k];
+
+      pCtx->mpTransformBlock(pCtx, mcuBlock);
+   }
+
+   return 0;
+}
+#endif
+//------------------------------------------------------------------------------
+static uint8 nextMCU(pjpeg_context_t *pCtx, uint8 skip)
+{
+   uint8 status;
+#if PJPG_STATS
+   unsigned long start, stages;
+#endif
+   
+   if (pCtx->mCallbackStatus)
+      return pCtx->mCallbackStatus;
+   
+   if ((!pCtx->mNumMCUSRemainingX) && (!pCtx->mNumMCUSRemainingY))
+      return PJPG_NO_MORE_BLOCKS;
+
+#if PJPG_STATS
+   // Decoding is what's left after the other stages timed within the MCU
+   stages = pCtx->mStats.m_inputTicks + pCtx->mStats.m_idctTicks + pCtx->mStats.m_colorTicks;
+   start = PJPG_STATS_CLOCK();
+#endif
+         
+#if PJPG_PROGRESSIVE
+   if (pCtx->mProgressive)
+   {
+      if (!pCtx->mpCoeffs)
+         return PJPG_UNSUPPORTED_MODE;
+
+      // Its coefficients are already in the buffer
+      status = skip ? 0 : outputProgressiveMCU(pCtx);
+   }
+   else
+#endif
+   status = decodeNextMCU(pCtx, skip);
+
+#if PJPG_STATS
+   stages = pCtx->mStats.m_inputTicks + pCtx->mStats.m_idctTicks + pCtx->mStats.m_colorTicks - stages;
+   pCtx->mStats.m_decodeTicks += PJPG_STATS_CLOCK() - start - stages;
+#endif
+
+   if ((status) || (pCtx->mCallbackStatus))
+      return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+
+   if (skip)
+      PJPG_STATS_INC(m_skippedMCUs);
+   else
+      PJPG_STATS_INC(m_MCUs);
+      
+   pCtx->mNumMCUSRemainingX--;
+   if (!pCtx->mNumMCUSRemainingX)
+   {
+      pCtx->mNumMCUSRemainingY--;
+	  if (pCtx->mNumMCUSRemainingY > 0)
+		  pCtx->mNumMCUSRemainingX = pCtx->mMaxMCUSPerRow;
+   }
+   
+   return 0;
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_mcu_ctx(pjpeg_context_t *pCtx)
+{
+   return nextMCU(pCtx, 0);
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_skip_mcu_ctx(pjpeg_context_t *pCtx)
+{
+   return nextMCU(pCtx, 1);
+}
+//------------------------------------------------------------------------------
+void pjpeg_set_output_ctx(pjpeg_context_t *pCtx, unsigned char output)
+{
+   pCtx->mOutput = output;
+   selectTransform(pCtx);
+}
+//------------------------------------------------------------------------------
+void pjpeg_set_upsampling_ctx(pjpeg_context_t *pCtx, unsigned char upsampling)
+{
+   pCtx->mUpsampling = upsampling;
+}
+//------------------------------------------------------------------------------
+// One row of triangle filtered chroma for output row y of the MCU, one value per
+// pixel: 3/4 of the nearest sample plus 1/4 of the next nearest, vertically then
+// horizontally. The rounding biases are libjpeg's. Samples past the edges of the
+// MCU's n x n chroma block are taken as the edge sample.
+static void fancyChroma(uint8* pOut, const uint8* pPlane, uint8 n, uint8 y, uint8 h, uint8 v, uint8 cols)
+{
+   const uint8* pNear = pPlane + (y >> v) * 8;
+   const uint8* pFar = pNear;
+   int16 s[8];
+   uint8 i, x;
+
+   if (v)
+   {
+      if (y & 1)
+      {
+         if ((y >> 1) + 1 < n)
+            pFar += 8;
+      }
+      else if (y >> 1)
+         pFar -= 8;
+   }
+
+#if PJPG_SIMD
+   if (n == 8)
+   {
+      simdFancyChroma(pOut, pNear, pFar, h);
+      return;
+   }
+#endif
+
+   for (i = 0; i < n; i++)
+      s[i] = (int16)(pNear[i] * 3 + pFar[i]);
+
+   for (x = 0; x < cols; x++)
+   {
+      i = x >> h;
+
+      if (!h)
+         pOut[x] = (uint8)((s[i] + 2) >> 2);
+      else if (x & 1)
+         pOut[x] = (uint8)((s[i] * 3 + s[(i + 1 < n) ? i + 1 : i] + 7) >> 4);
+      else
+         pOut[x] = (uint8)((s[i] * 3 + s[i ? i - 1 : 0] + 8) >> 4);
+   }
+}
+//------------------------------------------------------------------------------
+// pjpeg_mcu_to_rgb565_ctx() with PJPG_UPSAMPLE_FANCY, the chroma rows are filtered
+// first and then converted with the Y row as for H1V1.
+static void fancyToRGB565(const pjpeg_context_t *pCtx, unsigned short *pDst, unsigned int pitch, uint8 cols, uint8 rows, uint8 swap, uint8 bs, uint8 h, uint8 v)
+{
+   uint8 cb[16], cr[16];
+   uint8 n1 = (uint8)((1 << bs) - 1);
+   uint8 x, y;
+
+   for (y = 0; y < rows; y++)
+   {
+      const uint8* pY = pCtx->mMCUBufR + (y >> bs) * 128 + (y & n1) * 8;
+      unsigned short* pOut = pDst;
+
+      fancyChroma(cb, pCtx->mMCUBufG, n1 + 1, y, h, v, cols);
+      fancyChroma(cr, pCtx->mMCUBufB, n1 + 1, y, h, v, cols);
+
+      x = 0;
+
+#if PJPG_SIMD
+      if (bs == 3)
+      {
+         for ( ; x + 8 <= cols; x += 8, pOut += 8)
+            simdRGB565Row(pOut, pY + x * 8, cb + x, cr + x, 0, 0, swap);
+      }
+#endif
+
+      for ( ; x < cols; x++)
+      {
+         uint8 l = pY[(x >> bs) * 64 + (x & n1)];
+         int16 crR = (cr[x] + ((cr[x] * 103U) >> 8U)) - 179;
+         int16 crG = ((cr[x] * 183U) >> 8U) - 91;
+         int16 cbG = ((cb[x] * 88U) >> 8U) - 44U;
+         int16 cbB = (cb[x] + ((cb[x] * 198U) >> 8U)) - 227U;
+         uint8 r = addAndClamp(l, crR);
+         uint8 g = subAndClamp(subAndClamp(l, cbG), crG);
+         uint8 b = addAndClamp(l, cbB);
+         uint16 c = (uint16)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
+
+         *pOut++ = swap ? (uint16)((c >> 8) | (c << 8)) : c;
+      }
+
+      pDst += pitch;
+   }
+}
+//------------------------------------------------------------------------------
+// pjpeg_mcu_to_rgb565_ctx() for PJPG_GRAYSCALE, only the Y plane is used.
+static void grayToRGB565(const pjpeg_context_t *pCtx, unsigned short *pDst, unsigned int pitch, uint8 cols, uint8 rows, uint8 swap, uint8 bs)
+{
+   uint8 n1 = (uint8)((1 << bs) - 1);
+   uint8 x, y;
+
+   for (y = 0; y < rows; y++)
+   {
+      const uint8* pY = pCtx->mMCUBufR + (y >> bs) * 128 + (y & n1) * 8;
+      unsigned short* pOut = pDst;
+
+      x = 0;
+
+#if PJPG_SIMD
+      if (bs == 3)
+      {
+         for ( ; x + 8 <= cols; x += 8, pOut += 8)
+            simdRGB565Row(pOut, pY + x * 8, pY, pY, 0, 1, swap);
+      }
+#endif
+
+      for ( ; x < cols; x++)
+      {
+         uint8 l = pY[(x >> bs) * 64 + (x & n1)];
+         uint16 c = (uint16)(((l & 0xF8) << 8) | ((l & 0xFC) << 3) | (l >> 3));
+
+         *pOut++ = swap ? (uint16)((c >> 8) | (c << 8)) : c;
+      }
+
+      pDst += pitch;
+   }
+}
+//------------------------------------------------------------------------------
+// Upsamples and converts the MCU in one pass. The arithmetic and clamping (G after
+// each of its terms) is that of upsampleCb() etc. so the pixels are identical.
+void pjpeg_mcu_to_rgb565_ctx(const pjpeg_context_t *pCtx, unsigned short *pDst, unsigned int pitch, unsigned char cols, unsigned char rows, unsigned char swap)
+{
+   // log2 of the pixels per block side in each reduce mode
+   static const uint8 blockShift[4] = { 3, 0, 1, 2 };
+   uint8 bs = blockShift[pCtx->mReduce];
+   uint8 n1 = (uint8)((1 << bs) - 1);
+   uint8 hShift = ((pCtx->mScanType == PJPG_YH2V1) || (pCtx->mScanType == PJPG_YH2V2)) ? 1 : 0;
+   uint8 vShift = ((pCtx->mScanType == PJPG_YH1V2) || (pCtx->mScanType == PJPG_YH2V2)) ? 1 : 0;
+   uint8 x, y;
+
+   if (pCtx->mScanType == PJPG_GRAYSCALE)
+   {
+      grayToRGB565(pCtx, pDst, pitch, cols, rows, swap, bs);
+      return;
+   }
+
+   if ((pCtx->mUpsampling == PJPG_UPSAMPLE_FANCY) && (hShift | vShift))
+   {
+      fancyToRGB565(pCtx, pDst, pitch, cols, rows, swap, bs, hShift, vShift);
+      return;
+   }
+
+   for (y = 0; y < rows; y++)
+   {
+      const uint8* pY = pCtx->mMCUBufR + (y >> bs) * 128 + (y & n1) * 8;
+      const uint8* pCb = pCtx->mMCUBufG + (y >> vShift) * 8;
+      const uint8* pCr = pCtx->mMCUBufB + (y >> vShift) * 8;
+      unsigned short* pOut = pDst;
+
+      x = 0;
+
+#if PJPG_SIMD
+      // Whole rows of full size blocks, the rest of an edge MCU is done below
+      if (bs == 3)
+      {
+         for ( ; x + 8 <= cols; x += 8, pOut += 8)
+            simdRGB565Row(pOut, pY + x * 8, pCb + (x >> hShift), pCr + (x >> hShift), hShift, 0, swap);
+      }
+#endif
+
+      while (x < cols)
+      {
+         uint8 cb = pCb[x >> hShift];
+         uint8 cr = pCr[x >> hShift];
+         int16 crR = (cr + ((cr * 103U) >> 8U)) - 179;
+         int16 crG = ((cr * 183U) >> 8U) - 91;
+         int16 cbG = ((cb * 88U) >> 8U) - 44U;
+         int16 cbB = (cb + ((cb * 198U) >> 8U)) - 227U;
+         uint8 i = x + (1 << hShift);
+
+         // The 1 or 2 pixels sharing the chroma sample
+         if (i > cols)
+            i = cols;
+
+         for ( ; x < i; x++)
+         {
+            uint8 l = pY[(x >> bs) * 64 + (x & n1)];
+            uint8 r = addAndClamp(l, crR);
+            uint8 g = subAndClamp(subAndClamp(l, cbG), crG);
+            uint8 b = addAndClamp(l, cbB);
+            uint16 c = (uint16)(((r & 0xF8) << 8) | ((g & 0xFC) << 3) | (b >> 3));
+
+            *pOut++ = swap ? (uint16)((c >> 8) | (c << 8)) : c;
+         }
+      }
+
+      pDst += pitch;
+   }
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_scans_ctx(pjpeg_context_t *pCtx, short *pCoeffs, unsigned long size, unsigned char maxScans)
+{
+#if PJPG_PROGRESSIVE
+   uint8 status = 0, foundEOI, scans;
+   unsigned long i, coeffs;
+#if PJPG_STATS
+   unsigned long start = PJPG_STATS_CLOCK(), input = pCtx->mStats.m_inputTicks;
+#endif
+
+   if (!pCtx->mProgressive)
+      return 0;
+
+   coeffs = initCoeffBuf(pCtx) / sizeof(short);
+   if ((!pCoeffs) || (size < coeffs * sizeof(short)))
+      return PJPG_NOTENOUGHMEM;
+
+   for (i = 0; i < coeffs; i++)
+      pCoeffs[i] = 0;
+
+   pCtx->mpCoeffs = pCoeffs;
+
+   for (scans = 0; (!maxScans) || (scans < maxScans); scans++)
+   {
+      status = initProgressiveScan(pCtx, &foundEOI);
+      if ((status) || (pCtx->mCallbackStatus))
+         break;
+
+      if (foundEOI)
+         break;
+
+      status = decodeProgressiveScan(pCtx);
+      if ((status) || (pCtx->mCallbackStatus))
+         break;
+
+      PJPG_STATS_INC(m_scans);
+
+      // The entropy decoder stops at the marker after the scan, go back to reading markers
+      pCtx->mBitBuf = 0;
+      pCtx->mBitsLeft = 8;
+      getBits1(pCtx, 8);
+      getBits1(pCtx, 8);
+   }
+
+#if PJPG_STATS
+   pCtx->mStats.m_decodeTicks += PJPG_STATS_CLOCK() - start - (pCtx->mStats.m_inputTicks - input);
+#endif
+
+   if ((status) || (pCtx->mCallbackStatus))
+   {
+      pCtx->mpCoeffs = (short*)0;
+      return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+   }
+
+   for (i = 0; i < pCtx->mCompsInFrame; i++)
+      if ((pCtx->mValidQuantTables & (pCtx->mCompQuant[i] ? 2 : 1)) == 0)
+      {
+         pCtx->mpCoeffs = (short*)0;
+         return PJPG_UNDEFINED_QUANT_TABLE;
+      }
+
+   pCtx->mNumMCUSRemainingX = pCtx->mMaxMCUSPerRow;
+   pCtx->mNumMCUSRemainingY = pCtx->mMaxMCUSPerCol;
+
+   return 0;
+#else
+   (void)pCtx; (void)pCoeffs; (void)size; (void)maxScans;
+   return 0;
+#endif
+}
+//------------------------------------------------------------------------------
+// Reads the headers up to and including the frame (SOF) header, the input source must
+// already be set in pCtx. Clears pInfo.
+static uint8 frameInit(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, uint8 reduce)
+{
+   uint8 status;
+   
+   pInfo->m_width = 0; pInfo->m_height = 0; pInfo->m_comps = 0;
+   pInfo->m_MCUSPerRow = 0; pInfo->m_MCUSPerCol = 0;
+   pInfo->m_scanType = PJPG_GRAYSCALE;
+   pInfo->m_MCUWidth = 0; pInfo->m_MCUHeight = 0;
+   pInfo->m_pMCUBufR = (unsigned char*)0; pInfo->m_pMCUBufG = (unsigned char*)0; pInfo->m_pMCUBufB = (unsigned char*)0;
+   pInfo->m_restartInterval = 0;
+   pInfo->m_progressive = 0;
+   pInfo->m_coeffBufSize = 0;
+
+   pCtx->mCallbackStatus = 0;
+   pCtx->mReduce = (uint8)(reduce & ~PJPG_KEEP_TABLES);
+   pCtx->mOutput = PJPG_OUTPUT_RGB;
+   pCtx->mUpsampling = PJPG_UPSAMPLE_BOX;
+
+#if PJPG_STATS
+   memset(&pCtx->mStats, 0, sizeof(pCtx->mStats));
+#endif
+    
+   status = init(pCtx, reduce & PJPG_KEEP_TABLES);
+   if ((status) || (pCtx->mCallbackStatus))
+      return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+   
+   status = locateSOFMarker(pCtx);
+   if ((status) || (pCtx->mCallbackStatus))
+      return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+
+   status = initFrame(pCtx);
+   if ((status) || (pCtx->mCallbackStatus))
+      return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+
+   selectTransform(pCtx);
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+// Fills in the frame's part of pInfo once frameInit() has succeeded.
+static void setFrameInfo(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo)
+{
+#if PJPG_PROGRESSIVE
+   if (pCtx->mProgressive)
+   {
+      pInfo->m_progressive = 1;
+      pInfo->m_coeffBufSize = initCoeffBuf(pCtx);
+   }
+#endif
+
+   pInfo->m_width = pCtx->mImageXSize; pInfo->m_height = pCtx->mImageYSize; pInfo->m_comps = pCtx->mCompsInFrame;
+   pInfo->m_scanType = pCtx->mScanType;
+   pInfo->m_MCUSPerRow = pCtx->mMaxMCUSPerRow; pInfo->m_MCUSPerCol = pCtx->mMaxMCUSPerCol;
+   pInfo->m_MCUWidth = pCtx->mMaxMCUXSize; pInfo->m_MCUHeight = pCtx->mMaxMCUYSize;
+}
+//------------------------------------------------------------------------------
+// Reads the headers up to the first scan, the input source must already be set in pCtx.
+static uint8 decodeInit(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, uint8 reduce)
+{
+   uint8 status = frameInit(pCtx, pInfo, reduce);
+   if (status)
+      return status;
+
+#if PJPG_PROGRESSIVE
+   // Progressive scans are read later by pjpeg_decode_scans_ctx()
+   if (!pCtx->mProgressive)
+#endif
+   {
+      status = initScan(pCtx);
+      if ((status) || (pCtx->mCallbackStatus))
+         return pCtx->mCallbackStatus ? pCtx->mCallbackStatus : status;
+   }
+
+   setFrameInfo(pCtx, pInfo);
+   pInfo->m_pMCUBufR = pCtx->mMCUBufR; pInfo->m_pMCUBufG = pCtx->mMCUBufG; pInfo->m_pMCUBufB = pCtx->mMCUBufB;
+   pInfo->m_restartInterval = pCtx->mRestartInterval;
+      
+   return 0;
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_init_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, pjpeg_need_bytes_callback_t pNeed_bytes_callback, pjpeg_skip_bytes_callback_t pSkip_bytes_callback, void *pCallback_data, unsigned char reduce)
+{
+   pCtx->m_pNeedBytesCallback = pNeed_bytes_callback;
+   pCtx->m_pSkipBytesCallback = pSkip_bytes_callback;
+   pCtx->m_pCallback_data = pCallback_data;
+   pCtx->mpInData = (const uint8*)0;
+   pCtx->mInDataLeft = 0;
+
+   return decodeInit(pCtx, pInfo, reduce);
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_init_mem_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, const unsigned char *pData, unsigned long size, unsigned char reduce)
+{
+   pCtx->m_pNeedBytesCallback = (pjpeg_need_bytes_callback_t)0;
+   pCtx->m_pSkipBytesCallback = (pjpeg_skip_bytes_callback_t)0;
+   pCtx->m_pCallback_data = (void*)0;
+   pCtx->mpInData = pData;
+   pCtx->mInDataLeft = size;
+
+   return decodeInit(pCtx, pInfo, reduce);
+}
+//------------------------------------------------------------------------------
+static uint8 probe(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo)
+{
+   uint8 status = frameInit(pCtx, pInfo, PJPG_REDUCE_NONE);
+   if (status)
+      return status;
+
+   setFrameInfo(pCtx, pInfo);
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_probe_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, pjpeg_need_bytes_callback_t pNeed_bytes_callback, pjpeg_skip_bytes_callback_t pSkip_bytes_callback, void *pCallback_data)
+{
+   pCtx->m_pNeedBytesCallback = pNeed_bytes_callback;
+   pCtx->m_pSkipBytesCallback = pSkip_bytes_callback;
+   pCtx->m_pCallback_data = pCallback_data;
+   pCtx->mpInData = (const uint8*)0;
+   pCtx->mInDataLeft = 0;
+
+   return probe(pCtx, pInfo);
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_probe_mem_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, const unsigned char *pData, unsigned long size)
+{
+   pCtx->m_pNeedBytesCallback = (pjpeg_need_bytes_callback_t)0;
+   pCtx->m_pSkipBytesCallback = (pjpeg_skip_bytes_callback_t)0;
+   pCtx->m_pCallback_data = (void*)0;
+   pCtx->mpInData = pData;
+   pCtx->mInDataLeft = size;
+
+   return probe(pCtx, pInfo);
+}
+//------------------------------------------------------------------------------
+// Sets up pCtx for an interval, the callers then set its input source.
+static uint8 intervalInit(pjpeg_context_t *pCtx, const pjpeg_context_t *pHeaderCtx, unsigned long interval)
+{
+   unsigned long firstMCU;
+   uint16 mcuRow, mcuCol;
+
+   if (!pHeaderCtx->mRestartInterval)
+      return PJPG_BAD_RESTART_MARKER;
+
+#if PJPG_PROGRESSIVE
+   if (pHeaderCtx->mProgressive)
+      return PJPG_UNSUPPORTED_MODE;
+#endif
+
+   firstMCU = interval * pHeaderCtx->mRestartInterval;
+   mcuRow = (uint16)(firstMCU / pHeaderCtx->mMaxMCUSPerRow);
+   mcuCol = (uint16)(firstMCU % pHeaderCtx->mMaxMCUSPerRow);
+
+   if (mcuRow >= pHeaderCtx->mMaxMCUSPerCol)
+      return PJPG_BAD_RESTART_MARKER;
+
+   // The frame, scan and table state is shared by every interval.
+   if (pCtx != pHeaderCtx)
+      *pCtx = *pHeaderCtx;
+
+   pCtx->mCallbackStatus = 0;
+
+#if PJPG_STATS
+   // A context moved on to another interval of its own image keeps counting
+   if (pCtx != pHeaderCtx)
+      memset(&pCtx->mStats, 0, sizeof(pCtx->mStats));
+#endif
+
+   pCtx->mTemFlag = 0;
+   pCtx->mpInBuf = pCtx->mInBuf;
+   pCtx->mInBufLeft = 0;
+
+   // Each interval starts with fresh DC predictions and runs to the next marker.
+   pCtx->mLastDC[0] = 0;
+   pCtx->mLastDC[1] = 0;
+   pCtx->mLastDC[2] = 0;
+
+   pCtx->mRestartsLeft = pCtx->mRestartInterval;
+   pCtx->mNextRestartNum = (uint16)(interval & 7); // The RSTn that ends the interval
+
+   pCtx->mNumMCUSRemainingX = pCtx->mMaxMCUSPerRow - mcuCol;
+   pCtx->mNumMCUSRemainingY = pCtx->mMaxMCUSPerCol - mcuRow;
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_interval_init_ctx(pjpeg_context_t *pCtx, const pjpeg_context_t *pHeaderCtx, unsigned long interval, pjpeg_need_bytes_callback_t pNeed_bytes_callback, void *pCallback_data)
+{
+   uint8 status = intervalInit(pCtx, pHeaderCtx, interval);
+   if (status)
+      return status;
+
+   pCtx->m_pNeedBytesCallback = pNeed_bytes_callback;
+   pCtx->m_pCallback_data = pCallback_data;
+   pCtx->mpInData = (const uint8*)0;
+   pCtx->mInDataLeft = 0;
+
+   initEntropyBits(pCtx);
+
+   return pCtx->mCallbackStatus;
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_interval_init_mem_ctx(pjpeg_context_t *pCtx, const pjpeg_context_t *pHeaderCtx, unsigned long interval, const unsigned char *pData, unsigned long size)
+{
+   uint8 status = intervalInit(pCtx, pHeaderCtx, interval);
+   if (status)
+      return status;
+
+   pCtx->m_pNeedBytesCallback = (pjpeg_need_bytes_callback_t)0;
+   pCtx->m_pSkipBytesCallback = (pjpeg_skip_bytes_callback_t)0;
+   pCtx->m_pCallback_data = (void*)0;
+   pCtx->mpInData = pData;
+   pCtx->mInDataLeft = size;
+
+   initEntropyBits(pCtx);
+
+   return 0;
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_mcu(void)
+{
+   return pjpeg_decode_mcu_ctx(&gContext);
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_init(pjpeg_image_info_t *pInfo, pjpeg_need_bytes_callback_t pNeed_bytes_callback, void *pCallback_data, unsigned char reduce)
+{
+   return pjpeg_decode_init_ctx(&gContext, pInfo, pNeed_bytes_callback, (pjpeg_skip_bytes_callback_t)0, pCallback_data, reduce);
+}
+//------------------------------------------------------------------------------
+unsigned char pjpeg_decode_scans(short *pCoeffs, unsigned long size, unsigned char maxScans)
+{
+   return pjpeg_decode_scans_ctx(&gContext, pCoeffs, size, maxScans);
 }
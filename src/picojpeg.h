@@ -4,6 +4,152 @@
 #ifndef PICOJPEG_H
 #define PICOJPEG_H
 
+//------------------------------------------------------------------------------
+// Build options, define before including this header (or on the command line)
+// to override. The decoder context below depends on them, so picojpeg.c and its
+// callers must agree.
+// Set to 1 to decode Huffman codes of up to PJPG_HUFF_LOOKAHEAD_BITS bits with a
+// single table lookup instead of walking the code lengths a bit at a time.
+// Costs 512 bytes of RAM per Huffman table (2KB total), so it is disabled by
+// default on AVR where RAM is scarce.
+#ifndef PJPG_FAST_HUFFMAN
+  #ifdef __AVR__
+    #define PJPG_FAST_HUFFMAN 0
+  #else
+    #define PJPG_FAST_HUFFMAN 1
+  #endif
+#endif
+
+// Width in bits of the entropy decoder's bit reservoir. 16 keeps the original
+// octet at a time reader, which suits 8-bit MCUs best. 32 or 64 refill several
+// bytes at once so most codes and extra bits are read without a refill.
+#ifndef PJPG_BITBUF_BITS
+  #if defined (__AVR__)
+    #define PJPG_BITBUF_BITS 16
+  #elif defined (__SIZEOF_POINTER__) && (__SIZEOF_POINTER__ >= 8)
+    #define PJPG_BITBUF_BITS 64
+  #else
+    #define PJPG_BITBUF_BITS 32
+  #endif
+#endif
+
+#if PJPG_BITBUF_BITS == 64
+  #include <stdint.h>
+  typedef uint64_t pjpeg_bitbuf_t;
+#elif PJPG_BITBUF_BITS == 32
+  #include <stdint.h>
+  typedef uint32_t pjpeg_bitbuf_t;
+#elif PJPG_BITBUF_BITS != 16
+  #error "PJPG_BITBUF_BITS must be 16, 32 or 64"
+#endif
+
+// The bit buffer always holds (or is refilled to hold) at least 8 valid bits,
+// so the lookahead can peek at them directly.
+#define PJPG_HUFF_LOOKAHEAD_BITS 8
+#define PJPG_HUFF_LOOKAHEAD_SIZE (1 << PJPG_HUFF_LOOKAHEAD_BITS)
+
+// Set to 1 to also resolve an AC code together with its run length and
+// sign extended magnitude in one lookup, when both fit in the lookahead bits.
+// Needs PJPG_FAST_HUFFMAN and costs another 1KB of RAM.
+#ifndef PJPG_FAST_AC
+  #define PJPG_FAST_AC PJPG_FAST_HUFFMAN
+#endif
+
+#if PJPG_FAST_AC && !PJPG_FAST_HUFFMAN
+  #error "PJPG_FAST_AC requires PJPG_FAST_HUFFMAN"
+#endif
+
+// Set to 1 to support progressive JPEG's. All the scans have to be decoded
+// before any pixels can be output, so this needs a coefficient buffer of
+// 128 bytes per 8x8 block of the image, supplied by the caller (see
+// pjpeg_decode_scans_ctx()). Disabled by default on AVR which can't spare it.
+#ifndef PJPG_PROGRESSIVE
+  #ifdef __AVR__
+    #define PJPG_PROGRESSIVE 0
+  #else
+    #define PJPG_PROGRESSIVE 1
+  #endif
+#endif
+
+// Set to 1 to decode scans whose Huffman tables were never defined with the
+// standard ones from Annex K of the JPEG spec, as MJPEG frames (AVI files, many
+// IP cameras) leave out their DHT segment and expect. Costs 412 bytes of
+// constant data, which AVR would have to keep in RAM, so it is disabled there.
+#ifndef PJPG_DEFAULT_HUFF_TABLES
+  #ifdef __AVR__
+    #define PJPG_DEFAULT_HUFF_TABLES 0
+  #else
+    #define PJPG_DEFAULT_HUFF_TABLES 1
+  #endif
+#endif
+
+// Set to 1 to keep a hash of the bytes each Huffman and quantization table was
+// built from, so that when tables are kept with PJPG_KEEP_TABLES a DHT or DQT
+// segment defining the same table again (as every image from one encoder does)
+// is read without the table being built again. Costs 6 longs per context.
+#ifndef PJPG_TABLE_CACHE
+  #ifdef __AVR__
+    #define PJPG_TABLE_CACHE 0
+  #else
+    #define PJPG_TABLE_CACHE 1
+  #endif
+#endif
+
+// Size of the decoder's input buffer, which is also the most the need bytes
+// callback is asked for at a time. Larger buffers let file sources read whole
+// sectors or flash pages per call. Up to 256 the callback's sizes are unsigned
+// char as they always were (and 4 bytes of the buffer are kept back for putting
+// chars back), above that they are 16 or 32 bit as needed.
+#ifndef PJPG_MAX_IN_BUF_SIZE
+  #ifdef __AVR__
+    #define PJPG_MAX_IN_BUF_SIZE 256
+  #else
+    #define PJPG_MAX_IN_BUF_SIZE 4096
+  #endif
+#endif
+
+#if PJPG_MAX_IN_BUF_SIZE <= 256
+  typedef unsigned char pjpeg_size_t;
+  #define PJPG_IN_BUF_READ_SIZE (PJPG_MAX_IN_BUF_SIZE - 4)
+#else
+  #if (PJPG_MAX_IN_BUF_SIZE + 4) < 65536L
+    typedef unsigned short pjpeg_size_t;
+  #else
+    typedef unsigned long pjpeg_size_t;
+  #endif
+  #define PJPG_IN_BUF_READ_SIZE PJPG_MAX_IN_BUF_SIZE
+#endif
+
+// Set to 1 to run the IDCT and colour conversion 8 pixels at a time with SSE2
+// (x86) or NEON (ARM) intrinsics. The output is bit identical to the portable
+// code. On by default when the compiler targets either.
+#ifndef PJPG_SIMD
+  #if defined (__SSE2__) || defined (_M_X64) || defined (__ARM_NEON) || defined (__ARM_NEON__)
+    #define PJPG_SIMD 1
+  #else
+    #define PJPG_SIMD 0
+  #endif
+#endif
+
+// Set to 1 to collect the time spent in each stage of the decoder and a few
+// counters in the context's mStats (see pjpeg_stats_t). Times are in ticks of
+// PJPG_STATS_CLOCK(), micros() on Arduino and nanoseconds elsewhere. Define it
+// (and PJPG_STATS_CLOCK_HZ) as a cycle counter to time single blocks on an MCU.
+// The clock is read several times per block, so this is disabled by default.
+#ifndef PJPG_STATS
+  #define PJPG_STATS 0
+#endif
+
+#if PJPG_STATS && !defined (PJPG_STATS_CLOCK)
+  #ifdef ARDUINO
+    #define PJPG_STATS_CLOCK() micros()
+    #define PJPG_STATS_CLOCK_HZ 1000000UL
+  #else
+    #define PJPG_STATS_CLOCK() pjpeg_stats_clock()
+    #define PJPG_STATS_CLOCK_HZ 1000000000UL
+  #endif
+#endif
+//------------------------------------------------------------------------------
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -47,9 +193,38 @@ enum
    PJPG_NOTENOUGHMEM,
    PJPG_UNSUPPORTED_COMP_IDENT,
    PJPG_UNSUPPORTED_QUANT_TABLE,
-   PJPG_UNSUPPORTED_MODE,        // picojpeg doesn't support progressive JPEG's
+   PJPG_UNSUPPORTED_MODE,        // progressive JPEG without PJPG_PROGRESSIVE, or its scans haven't been decoded
 };  
 
+// Values for pjpeg_decode_init()'s reduce argument, the size each 8x8 block is decoded to
+enum
+{
+   PJPG_REDUCE_NONE = 0,   // 8x8 pixels, full size
+   PJPG_REDUCE_1_8,        // 1x1 pixel, DC only
+   PJPG_REDUCE_1_4,        // 2x2 pixels
+   PJPG_REDUCE_1_2         // 4x4 pixels
+};
+
+// May be or'ed into the reduce argument when pCtx has already decoded an image, such as the
+// previous frame of an MJPEG stream. The Huffman and quantization tables it defined are then
+// kept, so this image need only define the tables that differ (an abbreviated JPEG stream),
+// and with PJPG_TABLE_CACHE the tables it defines the same as the kept ones aren't rebuilt.
+#define PJPG_KEEP_TABLES 0x80
+
+// Values for pjpeg_set_output_ctx(), what pjpeg_decode_mcu_ctx() leaves in the MCU buffers
+enum
+{
+   PJPG_OUTPUT_RGB = 0,    // R, G and B (or Y for greyscale) as described in pjpeg_image_info_t
+   PJPG_OUTPUT_YCBCR       // Y, Cb and Cr for pjpeg_mcu_to_rgb565_ctx()
+};
+
+// Values for pjpeg_set_upsampling_ctx(), how pjpeg_mcu_to_rgb565_ctx() upsamples chroma
+enum
+{
+   PJPG_UPSAMPLE_BOX = 0,  // Each sample is repeated, fastest
+   PJPG_UPSAMPLE_FANCY     // Triangle filter, smooth colour edges
+};
+
 // Scan types
 typedef enum
 {
@@ -103,25 +278,282 @@ typedef struct
    // The 2x2 block array is organized at byte offsets:   0,  64, 
    //                                                   128, 192
    //
+   // In the reduced modes each block only holds 4x4, 2x2 or 1x1 pixels. These are in the top left corner of the
+   // block's 64 bytes, still 8 bytes apart per row.
+   //
    // It is up to the caller to copy or blit these pixels from these buffers into the destination bitmap.
    unsigned char *m_pMCUBufR;
    unsigned char *m_pMCUBufG;
    unsigned char *m_pMCUBufB;
+
+   // Number of MCU's between restart markers, or 0 if the image has none.
+   int m_restartInterval;
+
+   // 1 if the image is progressive, its scans must then be decoded with pjpeg_decode_scans_ctx()
+   // into a coefficient buffer of m_coeffBufSize bytes before calling pjpeg_decode_mcu_ctx().
+   int m_progressive;
+   unsigned long m_coeffBufSize;
 } pjpeg_image_info_t;
 
-typedef unsigned char (*pjpeg_need_bytes_callback_t)(unsigned char* pBuf, unsigned char buf_size, unsigned char *pBytes_actually_read, void *pCallback_data);
+#if PJPG_STATS
+// Accumulated from the start of each image (or restart interval) by the decoder.
+typedef struct
+{
+   // Ticks of PJPG_STATS_CLOCK() spent in each stage
+   unsigned long m_inputTicks;    // in the need bytes callback
+   unsigned long m_decodeTicks;   // Huffman decoding and dequantization, including progressive scans
+   unsigned long m_idctTicks;     // IDCT's
+   unsigned long m_colorTicks;    // chroma upsampling and YCbCr to RGB conversion
+   unsigned long m_outputTicks;   // not used by picojpeg, left for the caller's pixel output stage
+
+   unsigned long m_bytesRead;     // compressed bytes read from the source, including headers
+   unsigned long m_inputCalls;    // need bytes callbacks
+   unsigned long m_MCUs;          // MCU's decoded
+   unsigned long m_skippedMCUs;   // MCU's passed over with pjpeg_skip_mcu_ctx()
+   unsigned long m_blocks;        // 8x8 blocks transformed
+   unsigned long m_dcOnlyRows;    // IDCT row passes short circuited because only the DC was non-zero
+   unsigned long m_dcOnlyCols;    // the same for the column passes (neither is counted with PJPG_SIMD)
+   unsigned long m_restarts;      // restart markers processed
+   unsigned long m_scans;         // progressive scans decoded
+   unsigned long m_tablesKept;    // DHT and DQT tables not rebuilt, PJPG_TABLE_CACHE
+} pjpeg_stats_t;
+
+// Default PJPG_STATS_CLOCK() off Arduino, a monotonic nanosecond count
+unsigned long pjpeg_stats_clock(void);
+#endif
+
+typedef unsigned char (*pjpeg_need_bytes_callback_t)(unsigned char* pBuf, pjpeg_size_t buf_size, pjpeg_size_t *pBytes_actually_read, void *pCallback_data);
+
+// Optional, moves the source on by n bytes without reading them, so the segments the decoder
+// doesn't use (EXIF, ICC profiles, thumbnails, comments) are passed over by seeking. Returns 0
+// if it did, or non-zero to have the bytes read through pjpeg_need_bytes_callback_t and dropped.
+typedef unsigned char (*pjpeg_skip_bytes_callback_t)(unsigned long n, void *pCallback_data);
+
+typedef struct
+{
+   unsigned short mMinCode[16];
+   unsigned short mMaxCode[16];
+   unsigned char mValPtr[16];
+#if PJPG_FAST_HUFFMAN
+   // Indexed by the next PJPG_HUFF_LOOKAHEAD_BITS bits of the stream, a length
+   // of 0 means the code is longer than the lookahead (or invalid).
+   unsigned char mLookLen[PJPG_HUFF_LOOKAHEAD_SIZE];
+   unsigned char mLookVal[PJPG_HUFF_LOOKAHEAD_SIZE];
+#endif
+} pjpeg_huff_table_t;
+
+#if PJPG_FAST_AC
+// Indexed by the next PJPG_HUFF_LOOKAHEAD_BITS bits of the stream. mRunLen holds
+// the zero run in the top nibble and the total code + magnitude bits in the
+// bottom nibble (0 if they don't fit), mVal the sign extended coefficient.
+typedef struct
+{
+   unsigned char mRunLen[PJPG_HUFF_LOOKAHEAD_SIZE];
+   signed char mVal[PJPG_HUFF_LOOKAHEAD_SIZE];
+} pjpeg_fast_ac_table_t;
+#endif
+
+struct pjpeg_context_s;
+
+// Converts an 8x8 block of coefficients into the MCU buffers, picojpeg.c chooses one for each image
+typedef void (*pjpeg_transform_block_t)(struct pjpeg_context_s *pCtx, unsigned char mcuBlock);
+
+// All of the decoder's state. Each image being decoded at the same time needs
+// its own context, the members are private to picojpeg.c.
+typedef struct pjpeg_context_s
+{
+   // 128 bytes
+   short mCoeffBuf[8*8];
+
+   // 8*8*4 bytes * 3 = 768
+   unsigned char mMCUBufR[256];
+   unsigned char mMCUBufG[256];
+   unsigned char mMCUBufB[256];
+
+   // 256 bytes
+   short mQuant0[8*8];
+   short mQuant1[8*8];
+
+   // 6 bytes
+   short mLastDC[3];
+
+   // DC - 192
+   pjpeg_huff_table_t mHuffTab0;
+   unsigned char mHuffVal0[16];
+
+   pjpeg_huff_table_t mHuffTab1;
+   unsigned char mHuffVal1[16];
+
+   // AC - 672
+   pjpeg_huff_table_t mHuffTab2;
+   unsigned char mHuffVal2[256];
+
+   pjpeg_huff_table_t mHuffTab3;
+   unsigned char mHuffVal3[256];
+
+#if PJPG_FAST_AC
+   // AC - 1024
+   pjpeg_fast_ac_table_t mFastAC2;
+   pjpeg_fast_ac_table_t mFastAC3;
+#endif
+
+   unsigned char mValidHuffTables;
+   unsigned char mValidQuantTables;
+
+#if PJPG_TABLE_CACHE
+   // Hashes of the DHT and DQT bytes of the valid tables
+   unsigned long mHuffHash[4];
+   unsigned long mQuantHash[2];
+#endif
+
+   unsigned char mTemFlag;
+   unsigned char mInBuf[PJPG_IN_BUF_READ_SIZE + 4];
+   const unsigned char *mpInBuf; // Next input byte, in mInBuf or in the memory source
+   pjpeg_size_t mInBufLeft;
+
+   // Memory source set by the _mem_ctx functions, read in place instead of through mInBuf
+   const unsigned char *mpInData;
+   unsigned long mInDataLeft;
+
+   unsigned short mBitBuf;
+   unsigned char mBitsLeft;
+
+#if PJPG_BITBUF_BITS > 16
+   // Entropy coded data is read through a wider reservoir, left justified, holding
+   // mEntropyBitsLeft valid bits. Marker parsing still uses mBitBuf/mBitsLeft.
+   pjpeg_bitbuf_t mEntropyBitBuf;
+   unsigned char mEntropyBitsLeft;
+#endif
+
+   unsigned short mImageXSize;
+   unsigned short mImageYSize;
+   unsigned char mCompsInFrame;
+   unsigned char mCompIdent[3];
+   unsigned char mCompHSamp[3];
+   unsigned char mCompVSamp[3];
+   unsigned char mCompQuant[3];
+
+   unsigned short mRestartInterval;
+   unsigned short mNextRestartNum;
+   unsigned short mRestartsLeft;
+
+   unsigned char mCompsInScan;
+   unsigned char mCompList[3];
+   unsigned char mCompDCTab[3]; // 0,1
+   unsigned char mCompACTab[3]; // 0,1
+
+   pjpeg_scan_type_t mScanType;
+
+   unsigned char mMaxBlocksPerMCU;
+   unsigned char mMaxMCUXSize;
+   unsigned char mMaxMCUYSize;
+   unsigned short mMaxMCUSPerRow;
+   unsigned short mMaxMCUSPerCol;
+
+   unsigned short mNumMCUSRemainingX, mNumMCUSRemainingY;
+
+   unsigned char mMCUOrg[6];
+
+#if PJPG_PROGRESSIVE
+   unsigned char mProgressive;
+   unsigned char mSpectralStart, mSpectralEnd;
+   unsigned char mSuccessiveHigh, mSuccessiveLow;
+   unsigned short mEOBRun;
+   // Caller's coefficient buffer, each component's blocks in raster order padded to
+   // whole MCU's, starting at block mCompCoeffOfs[]. Coefficients are kept in zag order.
+   short *mpCoeffs;
+   unsigned long mCompCoeffOfs[3];
+#endif
+
+   pjpeg_need_bytes_callback_t m_pNeedBytesCallback;
+   pjpeg_skip_bytes_callback_t m_pSkipBytesCallback;
+   void *m_pCallback_data;
+   unsigned char mCallbackStatus;
+   unsigned char mReduce;
+   unsigned char mOutput;
+   unsigned char mUpsampling;
+   pjpeg_transform_block_t mpTransformBlock; // for mScanType, mReduce and mOutput
+
+#if PJPG_STATS
+   // Read only for the caller
+   pjpeg_stats_t mStats;
+#endif
+} pjpeg_context_t;
 
 // Initializes the decompressor. Returns 0 on success, or one of the above error codes on failure.
 // pNeed_bytes_callback will be called to fill the decompressor's internal input buffer.
-// If reduce is 1, only the first pixel of each block will be decoded. This mode is much faster because it skips the AC dequantization, IDCT and chroma upsampling of every image pixel.
-// Not thread safe.
+// If reduce is 1 (PJPG_REDUCE_1_8), only the first pixel of each block will be decoded. This mode is much faster because it skips the AC dequantization, IDCT and chroma upsampling of every image pixel.
+// PJPG_REDUCE_1_4 and PJPG_REDUCE_1_2 decode each block to 2x2 or 4x4 pixels with a reduced size IDCT.
+// Not thread safe, uses a single internal context.
 unsigned char pjpeg_decode_init(pjpeg_image_info_t *pInfo, pjpeg_need_bytes_callback_t pNeed_bytes_callback, void *pCallback_data, unsigned char reduce);
 
 // Decompresses the file's next MCU. Returns 0 on success, PJPG_NO_MORE_BLOCKS if no more blocks are available, or an error code.
 // Must be called a total of m_MCUSPerRow*m_MCUSPerCol times to completely decompress the image.
-// Not thread safe.
+// Not thread safe, uses a single internal context.
 unsigned char pjpeg_decode_mcu(void);
 
+// As above but all state is kept in the caller's context, so images can be decoded
+// concurrently as long as each uses its own context. The MCU buffers returned in
+// pInfo point into pCtx. pSkip_bytes_callback may be NULL if the source can't seek.
+unsigned char pjpeg_decode_init_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, pjpeg_need_bytes_callback_t pNeed_bytes_callback, pjpeg_skip_bytes_callback_t pSkip_bytes_callback, void *pCallback_data, unsigned char reduce);
+unsigned char pjpeg_decode_mcu_ctx(pjpeg_context_t *pCtx);
+
+// Passes over the next MCU as pjpeg_decode_mcu_ctx() would, but it is only entropy decoded (to
+// keep the DC predictions and the position in the stream). Its blocks aren't dequantized or
+// transformed and the MCU buffers are left as they were. For MCU's outside a region of interest.
+unsigned char pjpeg_skip_mcu_ctx(pjpeg_context_t *pCtx);
+
+// Prepares pCtx to decode a single restart interval of an image whose headers have
+// already been read into pHeaderCtx by pjpeg_decode_init_ctx(), so the intervals of an
+// image can be decoded in any order or in parallel (one context each).
+// pNeed_bytes_callback must supply the entropy coded data that follows the interval's RSTn
+// marker, or for interval 0 the data that follows the SOS marker.
+// Interval n starts at MCU n*m_restartInterval, call pjpeg_decode_mcu_ctx() up to
+// m_restartInterval times to decode it (decoding carries on into the following intervals
+// if it's called more). pCtx may be pHeaderCtx, to move a decode on to another interval.
+// Returns PJPG_BAD_RESTART_MARKER if the image has no restart interval or interval is past
+// the end of the image.
+unsigned char pjpeg_decode_interval_init_ctx(pjpeg_context_t *pCtx, const pjpeg_context_t *pHeaderCtx, unsigned long interval, pjpeg_need_bytes_callback_t pNeed_bytes_callback, void *pCallback_data);
+
+// Decodes the scans of a progressive image (m_progressive set by pjpeg_decode_init_ctx()) into
+// pCoeffs, which must be at least m_coeffBufSize bytes, after which the image is output an MCU at a
+// time with pjpeg_decode_mcu_ctx() as usual. If maxScans is non-zero only that many scans are
+// decoded, giving a lower quality preview without reading the rest of the file. pCoeffs must stay
+// valid until the last MCU has been decoded. Does nothing for baseline images.
+unsigned char pjpeg_decode_scans_ctx(pjpeg_context_t *pCtx, short *pCoeffs, unsigned long size, unsigned char maxScans);
+unsigned char pjpeg_decode_scans(short *pCoeffs, unsigned long size, unsigned char maxScans);
+
+// As pjpeg_decode_init_ctx() and pjpeg_decode_interval_init_ctx(), but the compressed data is
+// read in place from pData (size bytes) instead of being copied in through a callback.
+// pData must stay valid and byte addressable until the image (or interval) has been decoded.
+unsigned char pjpeg_decode_init_mem_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, const unsigned char *pData, unsigned long size, unsigned char reduce);
+unsigned char pjpeg_decode_interval_init_mem_ctx(pjpeg_context_t *pCtx, const pjpeg_context_t *pHeaderCtx, unsigned long interval, const unsigned char *pData, unsigned long size);
+
+// Reads only as far as the frame (SOF) header and fills in pInfo's size, component, scan type,
+// MCU and progressive members, to find out about an image without decoding it. Nothing is
+// entropy decoded and pCtx can't be used to decode the image afterwards. m_restartInterval and
+// the MCU buffer pointers are left 0.
+unsigned char pjpeg_probe_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, pjpeg_need_bytes_callback_t pNeed_bytes_callback, pjpeg_skip_bytes_callback_t pSkip_bytes_callback, void *pCallback_data);
+unsigned char pjpeg_probe_mem_ctx(pjpeg_context_t *pCtx, pjpeg_image_info_t *pInfo, const unsigned char *pData, unsigned long size);
+
+// Selects what pjpeg_decode_mcu_ctx() outputs, call after pjpeg_decode_init_ctx() which sets
+// PJPG_OUTPUT_RGB. With PJPG_OUTPUT_YCBCR the colour conversion is left to
+// pjpeg_mcu_to_rgb565_ctx(), which saves a pass over the RGB buffers when RGB565 is wanted.
+// Interval contexts take the mode of the header context.
+void pjpeg_set_output_ctx(pjpeg_context_t *pCtx, unsigned char output);
+
+// Selects the chroma upsampling of pjpeg_mcu_to_rgb565_ctx() for H2V1, H1V2 and H2V2
+// images, call after pjpeg_decode_init_ctx() which sets PJPG_UPSAMPLE_BOX. The filter
+// works within each MCU, samples past its edges are taken as the edge sample.
+void pjpeg_set_upsampling_ctx(pjpeg_context_t *pCtx, unsigned char upsampling);
+
+// Converts the last MCU decoded with PJPG_OUTPUT_YCBCR to RGB565 pixels, rows of pitch pixels
+// at pDst. Only the top left cols x rows pixels (at most the MCU's size, reduced as the image
+// is) are written, to clip MCU's at the image's right and bottom edges. If swap is non-zero
+// the bytes of each pixel are swapped. With PJPG_UPSAMPLE_BOX the pixels are the same as
+// those packed from the RGB output.
+void pjpeg_mcu_to_rgb565_ctx(const pjpeg_context_t *pCtx, unsigned short *pDst, unsigned int pitch, unsigned char cols, unsigned char rows, unsigned char swap);
+
 #ifdef __cplusplus
 }
 #endif